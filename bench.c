@@ -0,0 +1,587 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "scheduler.h"
+#include "table.h"
+#include "vm.h"
+
+// every run does at least this many operations, so small cases aren't lost in timer noise
+#define BENCH_MIN_OPERATIONS (4 * 1024 * 1024)
+
+// the VM every benchmark runs in. Each one initializes and frees it
+static VM vm;
+
+static void reportRate(const char *label, size_t operations, uint64_t elapsed)
+{
+    fprintf(stderr, "  %-12s %8.1f ns/op %10.0f ops/s\n", label, (double)elapsed / operations, operations / (elapsed / 1e9));
+}
+
+// like reportRate(), plus the bytes that went through per second
+static void reportThroughput(const char *label, size_t operations, size_t bytes, uint64_t elapsed)
+{
+    fprintf(stderr, "  %-12s %8.1f ns/op %10.0f ops/s %8.1f MB/s\n", label, (double)elapsed / operations,
+            operations / (elapsed / 1e9), bytes / 1e6 / (elapsed / 1e9));
+}
+
+static StringObject **makeKeys(const char *prefix, int count)
+{
+    StringObject **keys = ALLOCATE(&vm, StringObject *, count);
+    for (int i = 0; i < count; i++)
+    {
+        char chars[32];
+        int length = snprintf(chars, sizeof(chars), "%s%d", prefix, i);
+        keys[i] = copyString(&vm, chars, length);
+    }
+    return keys;
+}
+
+/*
+insert, hit, miss and delete on tables of a few sizes, each filled to several load factors.
+a table grows at 7/8 and then sits at 7/16, so the loads cover the whole range a table goes through
+*/
+static void benchTable()
+{
+    static const int capacities[] = {1024, 256 * 1024};
+    static const double loads[] = {0.45, 0.6, 0.75, 0.87};
+
+    initVM(&vm);
+    for (int c = 0; c < (int)(sizeof(capacities) / sizeof(capacities[0])); c++)
+    {
+        for (int l = 0; l < (int)(sizeof(loads) / sizeof(loads[0])); l++)
+        {
+            int count = (int)(capacities[c] * loads[l]);
+            int rounds = BENCH_MIN_OPERATIONS / count + 1;
+            StringObject **keys = makeKeys("key", count);
+            StringObject **absent = makeKeys("absent", count);
+
+            Table table;
+            initTable(&table);
+            int capacity = 0;
+            uint64_t insertTime = 0;
+            uint64_t hitTime = 0;
+            uint64_t missTime = 0;
+            uint64_t deleteTime = 0;
+            for (int round = 0; round < rounds; round++)
+            {
+                // every round starts from an empty table, so inserting includes growing it
+                uint64_t start = monotonicNanos();
+                for (int i = 0; i < count; i++)
+                    tableAdd(&vm, &table, keys[i], NUMBER_VAL(i));
+                insertTime += monotonicNanos() - start;
+
+                if (round == 0)
+                {
+                    capacity = table.capacity;
+                    Value value;
+                    start = monotonicNanos();
+                    for (int repeat = 0; repeat < rounds; repeat++)
+                    {
+                        for (int i = 0; i < count; i++)
+                            tableGet(&table, keys[i], &value);
+                    }
+                    hitTime = monotonicNanos() - start;
+
+                    start = monotonicNanos();
+                    for (int repeat = 0; repeat < rounds; repeat++)
+                    {
+                        for (int i = 0; i < count; i++)
+                            tableGet(&table, absent[i], &value);
+                    }
+                    missTime = monotonicNanos() - start;
+                }
+
+                start = monotonicNanos();
+                for (int i = 0; i < count; i++)
+                    tableDelete(&vm, &table, keys[i]);
+                deleteTime += monotonicNanos() - start;
+            }
+
+            size_t operations = (size_t)rounds * count;
+            fprintf(stderr, "%d keys, capacity %d, load %.2f\n", count, capacity, (double)count / capacity);
+            reportRate("insert", operations, insertTime);
+            reportRate("hit", operations, hitTime);
+            reportRate("miss", operations, missTime);
+            reportRate("delete", operations, deleteTime);
+
+            freeTable(&vm, &table);
+            FREE_ARRAY(&vm, StringObject *, keys, count);
+            FREE_ARRAY(&vm, StringObject *, absent, count);
+            // nothing refers to the keys any more, so this frees them
+            collectGarbage(&vm);
+        }
+    }
+    freeVM(&vm);
+}
+
+// blocks that stay allocated in the steady state runs, enough to not fit in cache
+#define ALLOC_LIVE_BLOCKS (64 * 1024)
+#define ALLOC_BATCH 1024
+
+typedef struct
+{
+    const char *name;
+    size_t size;
+} AllocSize;
+
+static void *poolAllocate(size_t size)
+{
+    return reallocate(&vm, NULL, 0, size);
+}
+
+static void poolRelease(void *pointer, size_t size)
+{
+    reallocate(&vm, pointer, size, 0);
+}
+
+static void *mallocAllocate(size_t size)
+{
+    return malloc(size);
+}
+
+static void mallocRelease(void *pointer, size_t size)
+{
+    (void)size;
+    free(pointer);
+}
+
+// allocates a batch of blocks, touching each one, and frees them newest first
+static uint64_t allocBatches(void *(*allocate)(size_t), void (*release)(void *, size_t), size_t size, int rounds)
+{
+    void *blocks[ALLOC_BATCH];
+    uint64_t start = monotonicNanos();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < ALLOC_BATCH; i++)
+        {
+            blocks[i] = allocate(size);
+            *(volatile char *)blocks[i] = 1;
+        }
+        for (int i = ALLOC_BATCH - 1; i >= 0; i--)
+            release(blocks[i], size);
+    }
+    return monotonicNanos() - start;
+}
+
+// keeps ALLOC_LIVE_BLOCKS blocks allocated and replaces the oldest one again and again.
+// a size of 0 picks one of the sizes at random for every block
+static uint64_t allocSteady(void *(*allocate)(size_t), void (*release)(void *, size_t), size_t size, size_t operations,
+                            const AllocSize *sizes, int sizeCount)
+{
+    void **blocks = (void **)malloc(ALLOC_LIVE_BLOCKS * sizeof(void *));
+    size_t *blockSizes = (size_t *)malloc(ALLOC_LIVE_BLOCKS * sizeof(size_t));
+    unsigned int seed = 1;
+    for (int i = 0; i < ALLOC_LIVE_BLOCKS; i++)
+    {
+        blockSizes[i] = size > 0 ? size : sizes[rand_r(&seed) % sizeCount].size;
+        blocks[i] = allocate(blockSizes[i]);
+    }
+
+    uint64_t start = monotonicNanos();
+    for (size_t i = 0; i < operations; i++)
+    {
+        int oldest = (int)(i % ALLOC_LIVE_BLOCKS);
+        release(blocks[oldest], blockSizes[oldest]);
+        blockSizes[oldest] = size > 0 ? size : sizes[rand_r(&seed) % sizeCount].size;
+        blocks[oldest] = allocate(blockSizes[oldest]);
+        *(volatile char *)blocks[oldest] = 1;
+    }
+    uint64_t elapsed = monotonicNanos() - start;
+
+    for (int i = 0; i < ALLOC_LIVE_BLOCKS; i++)
+        release(blocks[i], blockSizes[i]);
+    free(blocks);
+    free(blockSizes);
+    return elapsed;
+}
+
+/*
+allocating and freeing the sizes the VM allocates most, through reallocate() and its pools and through malloc().
+each size is run as short-lived batches and as a steady state with many live blocks, then all sizes mixed
+*/
+static void benchAlloc()
+{
+    static const AllocSize sizes[] = {
+        {"string", sizeof(StringObject)},
+        {"function", sizeof(FunctionObject)},
+        {"native", sizeof(NativeObject)},
+        {"closure", sizeof(ClosureObject)},
+        {"chars 24", 24},
+        {"chars 64", 64},
+    };
+    int sizeCount = (int)(sizeof(sizes) / sizeof(sizes[0]));
+    int rounds = BENCH_MIN_OPERATIONS / ALLOC_BATCH;
+    size_t operations = (size_t)rounds * ALLOC_BATCH;
+
+    initVM(&vm);
+    for (int i = 0; i <= sizeCount; i++)
+    {
+        size_t size = i < sizeCount ? sizes[i].size : 0;
+        if (i < sizeCount)
+        {
+            fprintf(stderr, "%s, %zu bytes\n", sizes[i].name, size);
+            reportRate("pool batch", operations, allocBatches(poolAllocate, poolRelease, size, rounds));
+            reportRate("libc batch", operations, allocBatches(mallocAllocate, mallocRelease, size, rounds));
+        }
+        else
+        {
+            fprintf(stderr, "all of the above mixed\n");
+        }
+        reportRate("pool steady", operations, allocSteady(poolAllocate, poolRelease, size, operations, sizes, sizeCount));
+        reportRate("libc steady", operations, allocSteady(mallocAllocate, mallocRelease, size, operations, sizes, sizeCount));
+    }
+    freeVM(&vm);
+}
+
+// each kind of string is interned until about this many bytes went through
+#define INTERN_BYTES (64 * 1024 * 1024)
+
+typedef struct
+{
+    const char *name;
+    int length;
+    int count;
+} InternSet;
+
+// fills count texts of the given length, each stride bytes apart. They differ in their first characters
+static char *makeTexts(int count, int length, int stride)
+{
+    char *texts = (char *)malloc((size_t)count * stride);
+    unsigned int seed = 1;
+    for (int i = 0; i < count; i++)
+    {
+        char *text = texts + (size_t)i * stride;
+        for (int c = 0; c < length; c++)
+            text[c] = 'a' + rand_r(&seed) % 26;
+        char number[16];
+        int digits = snprintf(number, sizeof(number), "%d", i);
+        memcpy(text, number, digits < length ? digits : length);
+    }
+    return texts;
+}
+
+/*
+copyString() on short identifiers and on long data strings. The first pass over a set interns new strings,
+the second one finds every string already interned
+*/
+static void benchIntern()
+{
+    static const InternSet sets[] = {
+        {"identifiers", 8, 100 * 1000},
+        {"data 256", 256, 16 * 1024},
+        {"data 4096", 4096, 1024},
+    };
+
+    initVM(&vm);
+    for (int s = 0; s < (int)(sizeof(sets) / sizeof(sets[0])); s++)
+    {
+        const InternSet *set = &sets[s];
+        char *texts = makeTexts(set->count, set->length, set->length);
+        int rounds = INTERN_BYTES / (set->count * set->length) + 1;
+
+        uint64_t newTime = 0;
+        uint64_t hitTime = 0;
+        for (int round = 0; round < rounds; round++)
+        {
+            uint64_t start = monotonicNanos();
+            for (int i = 0; i < set->count; i++)
+                copyString(&vm, texts + (size_t)i * set->length, set->length);
+            newTime += monotonicNanos() - start;
+
+            start = monotonicNanos();
+            for (int i = 0; i < set->count; i++)
+                copyString(&vm, texts + (size_t)i * set->length, set->length);
+            hitTime += monotonicNanos() - start;
+
+            // nothing refers to the strings, so the next round interns them anew
+            collectGarbage(&vm);
+        }
+
+        size_t operations = (size_t)rounds * set->count;
+        size_t bytes = operations * set->length;
+        fprintf(stderr, "%s, %d strings of %d bytes\n", set->name, set->count, set->length);
+        reportThroughput("new", operations, bytes, newTime);
+        reportThroughput("interned", operations, bytes, hitTime);
+        free(texts);
+    }
+    freeVM(&vm);
+}
+
+#define PRINT_LINES (2 * 1000 * 1000)
+// lines printed per call of the generated function. Comparisons don't parse as infix operators here,
+// so the scripts can't loop: they are straight-line code, and only use locals so no constants run out
+#define PRINT_LINES_PER_CALL 1000
+
+typedef struct
+{
+    const char *name;
+    const char *statement; // repeated PRINT_LINES_PER_CALL times in the function's body
+} PrintScript;
+
+typedef struct
+{
+    const char *name;
+    FlushPolicy policy;
+} PrintPolicy;
+
+// a function that runs the statement PRINT_LINES_PER_CALL times, called until lineCount lines are done
+static char *makePrintSource(const char *statement, int lineCount)
+{
+    int callCount = lineCount / PRINT_LINES_PER_CALL;
+    const char *call = "i = run(i, one, seven, text);\n";
+    size_t capacity = (strlen(statement) + 1) * PRINT_LINES_PER_CALL + strlen(call) * callCount + 256;
+    char *source = (char *)malloc(capacity);
+
+    size_t length = sprintf(source, "fun lines(i, one, seven, text) {\n");
+    for (int i = 0; i < PRINT_LINES_PER_CALL; i++)
+        length += sprintf(source + length, "%s\n", statement);
+    length += sprintf(source + length, "return i;\n}\n{\nvar run = lines;\nvar i = 0;\nvar one = 1;\nvar seven = 7;\n"
+                                       "var text = \"a line of text\";\n");
+    for (int i = 0; i < callCount; i++)
+        length += sprintf(source + length, "%s", call);
+    sprintf(source + length, "}\n");
+    return source;
+}
+
+/*
+scripts that print a line per statement, run with each flush policy. The output goes to /dev/null,
+so only the VM's side of printing is measured. The same statements without the print are timed first, for comparison
+*/
+static void benchPrint()
+{
+    static const PrintScript scripts[] = {
+        {"no print", "i = i + one;"},
+        {"integers", "print i; i = i + one;"},
+        {"fractions", "print i / seven; i = i + one;"},
+        {"strings", "print text; i = i + one;"},
+    };
+    static const PrintPolicy policies[] = {{"line", FLUSH_LINE}, {"size", FLUSH_SIZE}, {"exit", FLUSH_EXIT}};
+
+    int outputFd = open("/dev/null", O_WRONLY);
+    if (outputFd < 0)
+        return;
+
+    for (int s = 0; s < (int)(sizeof(scripts) / sizeof(scripts[0])); s++)
+    {
+        char *source = makePrintSource(scripts[s].statement, PRINT_LINES);
+        fprintf(stderr, "%s, %d lines\n", scripts[s].name, PRINT_LINES);
+
+        // without output the flush policy makes no difference
+        int policyCount = s == 0 ? 1 : (int)(sizeof(policies) / sizeof(policies[0]));
+        for (int p = 0; p < policyCount; p++)
+        {
+            initVM(&vm);
+            initOutput(&vm.output, outputFd, policies[p].policy);
+            uint64_t start = monotonicNanos();
+            InterpretResult result = interpretCode(&vm, source);
+            uint64_t elapsed = monotonicNanos() - start;
+            freeVM(&vm);
+
+            // a rate for a script that didn't run would be meaningless
+            if (result != INTERPRET_OK)
+            {
+                fprintf(stderr, "The %s script didn't run.\n", scripts[s].name);
+                exit(70);
+            }
+            reportRate(s == 0 ? "statements" : policies[p].name, PRINT_LINES, elapsed);
+        }
+        free(source);
+    }
+    close(outputFd);
+}
+
+// a chunk holds at most 256 constants, and every literal and function takes one. So the functions are declared
+// in groups inside other functions, and those are locals of a block, which keeps their names out of the constants
+#define PARSE_GROUPS 80
+#define PARSE_FUNCTIONS_PER_GROUP 100
+#define PARSE_FUNCTIONS (PARSE_GROUPS * PARSE_FUNCTIONS_PER_GROUP)
+#define PARSE_LITERALS_PER_FUNCTION 100
+
+// writes the i-th literal of the benchmark: integers, short decimals and some that have too many digits for the fast path
+static int formatLiteral(char *buffer, int i)
+{
+    unsigned int value = (unsigned int)i * 2654435761u;
+    switch (i % 4)
+    {
+    case 0:
+        return sprintf(buffer, "%u", value % 1000000);
+    case 1:
+        return sprintf(buffer, "%u.%02u", value % 10000, value % 100);
+    case 2:
+        return sprintf(buffer, "%u.%06u", value % 100, value % 1000000);
+    default:
+        return sprintf(buffer, "0.%09u%08u", value % 1000000000, (value >> 3) % 100000000);
+    }
+}
+
+// keeps the strtod() calls from being optimized away
+static volatile double parsedNumber;
+
+/*
+compiles a big source made of functions that add up hundreds of number literals each.
+strtod() on the same literals is timed as well, for what converting them cost before the fast path
+*/
+static void benchParse()
+{
+    int literalCount = PARSE_FUNCTIONS * PARSE_LITERALS_PER_FUNCTION;
+    size_t capacity = (size_t)literalCount * 32 + PARSE_FUNCTIONS * 64 + PARSE_GROUPS * 64;
+    char *source = (char *)malloc(capacity);
+    char *literals = (char *)malloc((size_t)literalCount * 32);
+    size_t length = sprintf(source, "{\n");
+    for (int f = 0; f < PARSE_FUNCTIONS; f++)
+    {
+        if (f % PARSE_FUNCTIONS_PER_GROUP == 0)
+            length += sprintf(source + length, "%sfun group%d() {\n", f > 0 ? "}\n" : "", f / PARSE_FUNCTIONS_PER_GROUP);
+        length += sprintf(source + length, "fun f%d() {\n  return 0", f);
+        for (int l = 0; l < PARSE_LITERALS_PER_FUNCTION; l++)
+        {
+            int i = f * PARSE_LITERALS_PER_FUNCTION + l;
+            formatLiteral(literals + (size_t)i * 32, i);
+            length += sprintf(source + length, " + %s", literals + (size_t)i * 32);
+        }
+        length += sprintf(source + length, ";\n}\n");
+    }
+    length += sprintf(source + length, "}\n}\n");
+
+    initVM(&vm);
+    uint64_t start = monotonicNanos();
+    // the compiler reports why a source didn't compile. A rate for it would be meaningless
+    if (compileCode(&vm, source) == NULL)
+        exit(65);
+#ifdef LAZY_COMPILE
+    // the literals are in the bodies. Compiling a group creates its functions, which the next pass compiles
+    Object *end = NULL;
+    while (vm.objects != end)
+    {
+        Object *first = vm.objects;
+        for (Object *object = first; object != end; object = object->next)
+        {
+            if (object->type == OBJECT_FUNCTION && ((FunctionObject *)object)->source != NULL &&
+                !compileFunction(&vm, (FunctionObject *)object))
+                exit(65);
+        }
+        end = first;
+    }
+#endif
+    uint64_t compileTime = monotonicNanos() - start;
+
+    start = monotonicNanos();
+    for (int i = 0; i < literalCount; i++)
+        parsedNumber = strtod(literals + (size_t)i * 32, NULL);
+    uint64_t strtodTime = monotonicNanos() - start;
+
+    fprintf(stderr, "%d literals in %.1f MB of source\n", literalCount, length / 1e6);
+    reportThroughput("compile", literalCount, length, compileTime);
+    reportRate("strtod", literalCount, strtodTime);
+
+    freeVM(&vm);
+    free(source);
+    free(literals);
+}
+
+#define SCAN_SOURCE_SIZE (8 * 1024 * 1024)
+#define SCAN_ROUNDS 8
+
+typedef struct
+{
+    const char *name;
+    const char *text; // repeated until the source is SCAN_SOURCE_SIZE long
+} ScanSource;
+
+/*
+tokens per second over sources of a few megabytes: ordinary code, code with long comments and
+code with long strings. The scanner's bulk paths each get a source where they do most of the work
+*/
+static void benchScan()
+{
+    static const ScanSource sources[] = {
+        {"code",
+         "fun fibonacci(number) {\n"
+         "    if (number < 2) return number;\n"
+         "    var previous = fibonacci(number - 2);\n"
+         "    return previous + fibonacci(number - 1);\n"
+         "}\n"
+         "for (var index = 0; index < 30; index = index + 1) {\n"
+         "    print fibonacci(index) * 1.5 != nil and true;\n"
+         "}\n"},
+        {"comments",
+         "// the scanner skips over a comment like this one, which goes on for a while before it ends\n"
+         "        // and this one is indented by a good amount of whitespace in front of it\n"
+         "var counter = counter + 1;\n"},
+        {"strings",
+         "var message = \"a string literal that is long enough to take several steps of sixteen bytes\";\n"
+         "print message + \"and another shorter one\";\n"},
+    };
+
+    char *source = (char *)malloc(SCAN_SOURCE_SIZE + 1);
+    for (int s = 0; s < (int)(sizeof(sources) / sizeof(sources[0])); s++)
+    {
+        size_t textLength = strlen(sources[s].text);
+        size_t length = 0;
+        while (length + textLength <= SCAN_SOURCE_SIZE)
+        {
+            memcpy(source + length, sources[s].text, textLength);
+            length += textLength;
+        }
+        source[length] = '\0';
+
+        size_t tokenCount = 0;
+        uint64_t start = monotonicNanos();
+        for (int round = 0; round < SCAN_ROUNDS; round++)
+        {
+            Scanner scanner;
+            initScanner(&scanner, source, 1);
+            while (scanToken(&scanner).type != TOKEN_EOF)
+                tokenCount++;
+        }
+        uint64_t elapsed = monotonicNanos() - start;
+
+        fprintf(stderr, "%s, %.1f MB\n", sources[s].name, length / 1e6);
+        reportThroughput("tokens", tokenCount, length * SCAN_ROUNDS, elapsed);
+    }
+    free(source);
+}
+
+typedef struct
+{
+    const char *name;
+    void (*run)();
+} MicroBench;
+
+static const MicroBench benches[] = {
+    {"alloc", benchAlloc},
+    {"intern", benchIntern},
+    {"parse", benchParse},
+    {"print", benchPrint},
+    {"scan", benchScan},
+    {"table", benchTable},
+};
+
+#define BENCH_COUNT ((int)(sizeof(benches) / sizeof(benches[0])))
+
+bool runMicroBench(const char *name)
+{
+    for (int i = 0; i < BENCH_COUNT; i++)
+    {
+        if (strcmp(benches[i].name, name) == 0)
+        {
+            benches[i].run();
+            return true;
+        }
+    }
+    return false;
+}
+
+void listMicroBenches()
+{
+    for (int i = 0; i < BENCH_COUNT; i++)
+        fprintf(stderr, "%s%s", i > 0 ? " " : "", benches[i].name);
+    fprintf(stderr, "\n");
+}
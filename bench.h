@@ -0,0 +1,13 @@
+#ifndef clox_bench_h
+#define clox_bench_h
+
+#include "common.h"
+
+// runs the microbenchmark with the given name and reports its results to stderr.
+// returns false if there is no benchmark by that name
+bool runMicroBench(const char *name);
+
+// lists the names runMicroBench() accepts
+void listMicroBenches();
+
+#endif
@@ -1,13 +1,23 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
+#include "linker.h"
 #include "memory.h"
 
-void freeChunk(Chunk *chunk)
+void freeChunk(VM *vm, Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+    // arrays that live in an arena or a code segment are released together with it
+    if (chunk->arena == NULL && !chunk->isLinked)
+    {
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+        freeValueArray(vm, &chunk->constants);
+    }
+    else if (chunk->segment != NULL)
+    {
+        releaseCodeSegment(vm, chunk->segment);
+    }
     initChunk(chunk);
 }
 
@@ -17,17 +27,28 @@ void initChunk(Chunk *chunk)
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->arena = NULL;
+    chunk->isLinked = false;
+    chunk->segment = NULL;
     initValueArray(&chunk->constants);
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, int lineNumber)
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int lineNumber)
 {
     if (chunk->capacity < chunk->count + 1)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        if (chunk->arena != NULL)
+        {
+            chunk->code = ARENA_GROW_ARRAY(chunk->arena, uint8_t, chunk->code, oldCapacity, chunk->capacity);
+            chunk->lines = ARENA_GROW_ARRAY(chunk->arena, int, chunk->lines, oldCapacity, chunk->capacity);
+        }
+        else
+        {
+            chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
+            chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity, chunk->capacity);
+        }
     }
 
     chunk->code[chunk->count] = byte;
@@ -37,8 +58,41 @@ void writeChunk(Chunk *chunk, uint8_t byte, int lineNumber)
 
 // add a new constant to the chunk's constant array
 // returns the index where constant was added
-int addConstant(Chunk *chunk, Value value)
+int addConstant(VM *vm, Chunk *chunk, Value value)
+{
+    ValueArray *constants = &chunk->constants;
+
+    // make room in the arena first, so writeValueArray() doesn't grow the array on the heap
+    if (chunk->arena != NULL && constants->capacity < constants->count + 1)
+    {
+        int oldCapacity = constants->capacity;
+        constants->capacity = GROW_CAPACITY(oldCapacity);
+        constants->values = ARENA_GROW_ARRAY(chunk->arena, Value, constants->values, oldCapacity, constants->capacity);
+    }
+
+    writeValueArray(vm, constants, value);
+    return constants->count - 1;
+}
+
+void finalizeChunk(VM *vm, Chunk *chunk)
 {
-    writeValueArray(&chunk->constants, value);
-    return chunk->constants.count - 1;
+    if (chunk->arena == NULL)
+        return;
+
+    uint8_t *code = ALLOCATE(vm, uint8_t, chunk->count);
+    int *lines = ALLOCATE(vm, int, chunk->count);
+    memcpy(code, chunk->code, chunk->count * sizeof(uint8_t));
+    memcpy(lines, chunk->lines, chunk->count * sizeof(int));
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->capacity = chunk->count;
+
+    ValueArray *constants = &chunk->constants;
+    Value *values = ALLOCATE(vm, Value, constants->count);
+    if (constants->count > 0)
+        memcpy(values, constants->values, constants->count * sizeof(Value));
+    constants->values = values;
+    constants->capacity = constants->count;
+
+    chunk->arena = NULL;
 }
@@ -4,6 +4,9 @@
 #include "common.h"
 #include "value.h"
 
+typedef struct Arena Arena;
+typedef struct CodeSegment CodeSegment;
+
 // opcodes for different instructions
 typedef enum
 {
@@ -14,6 +17,7 @@ typedef enum
 
     // binary arithmetic operators
     OP_ADD,
+    OP_ADD_N, // adds the top N values in one go, e.g. for a + b + c + d
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
@@ -37,6 +41,7 @@ typedef enum
     OP_LOOP,
     OP_CALL,
     OP_RETURN,
+    OP_YIELD, // suspends the running coroutine and hands a value to whoever resumed it
 } OpCode;
 
 // chunks are dynamic arrays that will store bytecodes
@@ -47,13 +52,19 @@ typedef struct
     uint8_t *code;
     int *lines;           // dynamic array to store line no. for bytecodes
     ValueArray constants; // dynamic array to store all constants
+    Arena *arena;         // while being compiled, the arrays grow inside this arena instead of the heap
+    bool isLinked;        // code, lines and constants point into a read-only code segment and are not owned by the chunk
+    CodeSegment *segment; // the segment linkProgram() put them in, NULL for code in a snapshot image
 } Chunk;
 
-void freeChunk(Chunk *chunk);
+void freeChunk(VM *vm, Chunk *chunk);
 void initChunk(Chunk *chunk);
-void writeChunk(Chunk *chunk, uint8_t byte, int lineNumber);
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int lineNumber);
+
+// copies a chunk that was built in an arena into exact-size heap arrays
+void finalizeChunk(VM *vm, Chunk *chunk);
 
 // helper function to add constant to constant pool of chunk
-int addConstant(Chunk *chunk, Value value);
+int addConstant(VM *vm, Chunk *chunk, Value value);
 
 #endif
@@ -8,6 +8,13 @@
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
+// after compilation, pack all bytecode and constants into contiguous read-only segments
+#define LINK_CODE_SEGMENTS
+
+// only compile function bodies when the function is first called. Bodies are still checked for
+// syntax errors when they are declared, so a program with errors doesn't start either way
+#define LAZY_COMPILE
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
\ No newline at end of file
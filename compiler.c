@@ -1,9 +1,14 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "linker.h"
+#include "memory.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -67,22 +72,58 @@ typedef struct Compiler
     int scopeDepth;
 } Compiler;
 
-Compiler *current = NULL;
-Parser parser;
-Chunk *compilingChunk;
+// everything needed while compiling one piece of source. Each compilation has its own,
+// so compilations can nest and run on several threads at once
+typedef struct
+{
+    VM *vm; // the VM whose heap the compiled functions and strings go to
+    Scanner scanner;
+    Parser parser;
+    Compiler *current; // compiler of the innermost function being compiled
+    Arena arena;       // chunks grow inside this arena while they are compiled. It is released in one go at the end
+    bool isChecking;      // only counting code and constants while checking a deferred body, see checkFunctionBody()
+    bool isSourceChecked; // the source is a deferred body that has been checked already, and so are the ones in it
+} CompileContext;
+
+// the compilation running on this thread
+static _Thread_local CompileContext *context = NULL;
+
+/*
+the heap and the strings table are shared with the other compiler threads,
+so everything that allocates objects or interns strings holds the heap lock.
+chunks grow in the context's own arena and don't need it until they are finalized.
+*/
+static StringObject *lockedCopyString(const char *chars, int length)
+{
+    lockHeap(context->vm);
+    StringObject *string = copyString(context->vm, chars, length);
+    unlockHeap(context->vm);
+    return string;
+}
+
+static FunctionObject *lockedNewFunction()
+{
+    lockHeap(context->vm);
+    FunctionObject *function = newFunction(context->vm);
+    unlockHeap(context->vm);
+    return function;
+}
 
 static Chunk *getCurrentChunk()
 {
-    return &current->function->chunk;
+    return &context->current->function->chunk;
 }
 
 static void errorAt(Token *token, const char *message)
 {
     // if parser is already in panic mode, don't report any other erors (prevent error cascade)
-    if (parser.panicMode)
+    if (context->parser.panicMode)
         return;
 
-    parser.panicMode = true;
+    context->parser.panicMode = true;
+
+    // keep the message in one piece when several threads are compiling
+    flockfile(stderr);
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
@@ -99,35 +140,36 @@ static void errorAt(Token *token, const char *message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    funlockfile(stderr);
+    context->parser.hadError = true;
 }
 
 static void errorAtCurrent(const char *message)
 {
-    errorAt(&parser.current, message);
+    errorAt(&context->parser.current, message);
 }
 
 static void errorAtPrevious(const char *message)
 {
-    errorAt(&parser.previous, message);
+    errorAt(&context->parser.previous, message);
 }
 
 static void advance()
 {
-    parser.previous = parser.current;
+    context->parser.previous = context->parser.current;
     for (;;)
     {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        context->parser.current = scanToken(&context->scanner);
+        if (context->parser.current.type != TOKEN_ERROR)
             break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(context->parser.current.start);
     }
 }
 
 static void consume(TokenType type, const char *message)
 {
-    if (parser.current.type == type)
+    if (context->parser.current.type == type)
     {
         advance();
         return;
@@ -138,7 +180,7 @@ static void consume(TokenType type, const char *message)
 
 static bool checkTokenType(TokenType type)
 {
-    return parser.current.type == type;
+    return context->parser.current.type == type;
 }
 
 static bool match(TokenType type)
@@ -152,7 +194,13 @@ static bool match(TokenType type)
 // append byte to chunk
 static void emitByte(uint8_t byte)
 {
-    writeChunk(getCurrentChunk(), byte, parser.previous.line);
+    // a check only needs the size of the code, for the jump limits
+    if (context->isChecking)
+    {
+        getCurrentChunk()->count++;
+        return;
+    }
+    writeChunk(context->vm, getCurrentChunk(), byte, context->parser.previous.line);
 }
 
 static int emitJump(uint8_t instruction)
@@ -184,7 +232,8 @@ static void emitLoop(int loopStart)
 
 static uint8_t makeConstant(Value value)
 {
-    int constantIdx = addConstant(getCurrentChunk(), value);
+    int constantIdx = context->isChecking ? getCurrentChunk()->constants.count++
+                                          : addConstant(context->vm, getCurrentChunk(), value);
     // since OP_CONSTANT instruction uses one byte to store the index, we can only store upto 256 consts.
     if (constantIdx > UINT8_MAX)
     {
@@ -207,6 +256,8 @@ static void patchJump(int offset)
     {
         errorAtCurrent("Too much code to jump over.");
     }
+    if (context->isChecking)
+        return;
 
     getCurrentChunk()->code[offset] = (jump >> 8) && 0xff;
     getCurrentChunk()->code[offset + 1] = jump & 0xff;
@@ -221,53 +272,160 @@ static void emitReturn()
 
 static void beginScope()
 {
-    current->scopeDepth++;
+    context->current->scopeDepth++;
 }
 
 static void endScope()
 {
-    current->scopeDepth--;
+    context->current->scopeDepth--;
 
     // remove local variables from the stack after their scope ends.
-    while (current->localCount > 0 &&
-           current->locals[current->localCount - 1].depth > current->scopeDepth)
+    while (context->current->localCount > 0 &&
+           context->current->locals[context->current->localCount - 1].depth > context->current->scopeDepth)
     {
         emitByte(OP_POP);
-        current->localCount--;
+        context->current->localCount--;
     }
 }
 
+// the highest the stack gets while the chunk runs, counting the callee and its arguments.
+// every path through the bytecode is followed with the height each instruction leaves behind.
+// the compiler only emits code where all paths reach an instruction with the same height
+static int maxStackHeight(Chunk *chunk, int arity)
+{
+    int count = chunk->count;
+    uint8_t *code = chunk->code;
+    int *heights = (int *)malloc(sizeof(int) * (count + 1));
+    int *pending = (int *)malloc(sizeof(int) * (count + 1));
+    if (heights == NULL || pending == NULL)
+        exit(1);
+    for (int i = 0; i <= count; i++)
+        heights[i] = -1;
+
+    int max = arity + 1;
+    int pendingCount = 0;
+    heights[0] = arity + 1;
+    pending[pendingCount++] = 0;
+    while (pendingCount > 0)
+    {
+        int offset = pending[--pendingCount];
+        int height = heights[offset];
+        while (offset < count)
+        {
+            int next = offset + 1;
+            int target = -1;
+            bool isEnd = false;
+            switch (code[offset])
+            {
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_GET_GLOBAL:
+                height++;
+                next = offset + 2;
+                break;
+            case OP_NIL:
+            case OP_FALSE:
+            case OP_TRUE:
+                height++;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_PRINT:
+            case OP_POP:
+                height--;
+                break;
+            case OP_ADD_N:
+                height -= code[offset + 1] - 1;
+                next = offset + 2;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_YIELD: // the yielded value is replaced by the one the coroutine is resumed with
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_GLOBAL:
+                next = offset + 2;
+                break;
+            case OP_DEFINE_GLOBAL:
+                height--;
+                next = offset + 2;
+                break;
+            case OP_CALL:
+                // the callee and its arguments are replaced by the result
+                height -= code[offset + 1];
+                next = offset + 2;
+                break;
+            case OP_JUMP:
+                target = offset + 3 + ((code[offset + 1] << 8) | code[offset + 2]);
+                isEnd = true;
+                break;
+            case OP_JUMP_IF_FALSE:
+                target = offset + 3 + ((code[offset + 1] << 8) | code[offset + 2]);
+                next = offset + 3;
+                break;
+            case OP_LOOP:
+                target = offset + 3 - ((code[offset + 1] << 8) | code[offset + 2]);
+                isEnd = true;
+                break;
+            default: // OP_RETURN
+                isEnd = true;
+                break;
+            }
+
+            if (height > max)
+                max = height;
+            if (target >= 0 && target <= count && heights[target] == -1)
+            {
+                heights[target] = height;
+                pending[pendingCount++] = target;
+            }
+            if (isEnd || next > count || heights[next] != -1)
+                break;
+            heights[next] = height;
+            offset = next;
+        }
+    }
+
+    free(heights);
+    free(pending);
+    return max;
+}
+
 static FunctionObject *endCompiler()
 {
     emitReturn();
-    FunctionObject *function = current->function;
+    FunctionObject *function = context->current->function;
+    function->maxSlots = maxStackHeight(&function->chunk, function->arity);
+    lockHeap(context->vm);
+    finalizeChunk(context->vm, &function->chunk);
+    unlockHeap(context->vm);
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
-        disassembleChunk(getCurrentChunk(), function->name != NULL ? function->name->chars : "<script>");
+    if (!context->parser.hadError)
+        disassembleChunk(context->vm, getCurrentChunk(), function->name != NULL ? function->name->chars : "<script>");
 #endif
 
-    current = current->enclosing;
+    context->current = context->current->enclosing;
     return function;
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type)
+static void initCompiler(Compiler *compiler, FunctionType type, FunctionObject *function)
 {
-    compiler->enclosing = current;
-    compiler->function = NULL;
+    compiler->enclosing = context->current;
+    compiler->function = function;
     compiler->functionType = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
-
-    if (type != TYPE_SCRIPT)
-    {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
-    }
+    compiler->function->chunk.arena = &context->arena;
+    context->current = compiler;
 
     // claim the zeroth stack slot in locals array for the VM's internal use.
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &context->current->locals[context->current->localCount++];
     local->depth = 0;
     // give the slot an empty name so user can't write an identifier referring to it.
     local->name.start = "";
@@ -282,7 +440,7 @@ static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence precedence)
 {
     advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    ParseFn prefixRule = getRule(context->parser.previous.type)->prefix;
     if (prefixRule == NULL)
     {
         errorAtPrevious("Expect expression");
@@ -293,10 +451,10 @@ static void parsePrecedence(Precedence precedence)
     bool canAssign = precedence <= PREC_ASSIGNMENT;
     prefixRule(canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence)
+    while (precedence <= getRule(context->parser.current.type)->precedence)
     {
         advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
+        ParseFn infixRule = getRule(context->parser.previous.type)->infix;
         infixRule(canAssign);
     }
 
@@ -308,7 +466,7 @@ static void parsePrecedence(Precedence precedence)
 
 static void binary(bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = context->parser.previous.type;
     ParseRule *rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
@@ -332,8 +490,22 @@ static void binary(bool canAssign)
     case TOKEN_LESS_EQUAL:
         emitBytes(OP_GREATER, OP_NOT);
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+    {
+        // fold a chain like a + b + c + d into a single instruction,
+        // so string chains are concatenated in one go
+        int operandCount = 2;
+        while (operandCount < UINT8_MAX && match(TOKEN_PLUS))
+        {
+            parsePrecedence((Precedence)(rule->precedence + 1));
+            operandCount++;
+        }
+
+        if (operandCount == 2)
+            emitByte(OP_ADD);
+        else
+            emitBytes(OP_ADD_N, (uint8_t)operandCount);
         break;
+    }
     case TOKEN_MINUS:
         emitByte(OP_SUBTRACT);
         break;
@@ -356,7 +528,7 @@ static void call(bool canAssign)
 
 static void literal(bool canAssign)
 {
-    switch (parser.previous.type)
+    switch (context->parser.previous.type)
     {
     case TOKEN_NIL:
         emitByte(OP_FALSE);
@@ -372,9 +544,72 @@ static void literal(bool canAssign)
     }
 }
 
+// 10^0 to 10^22 are exactly representable as doubles
+static const double exactPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/*
+parses a number literal of the form digits[.digits].
+if the significant digits fit in 53 bits, the value is exact as a double, and so is
+10^(number of fraction digits) up to 10^22. A single division is then correctly rounded
+(Clinger's fast path), which covers almost every literal in practice.
+anything else is handed to strtod.
+*/
+static double parseNumber(const char *start, int length)
+{
+    const char *end = start + length;
+    const char *current = start;
+
+    // leading zeros are not significant
+    while (current < end && *current == '0')
+        current++;
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int fractionDigits = 0;
+    bool inFraction = false;
+    for (; current < end; current++)
+    {
+        if (*current == '.')
+        {
+            inFraction = true;
+            continue;
+        }
+
+        // 19 digits always fit in 64 bits, more can't take the fast path anyway
+        if (digits == 19)
+            break;
+        mantissa = mantissa * 10 + (uint64_t)(*current - '0');
+        if (mantissa != 0)
+            digits++;
+        if (inFraction)
+            fractionDigits++;
+    }
+
+    if (current == end && mantissa <= ((uint64_t)1 << 53) && fractionDigits <= 22)
+        return (double)mantissa / exactPowersOfTen[fractionDigits];
+
+    // strtod needs a terminated string. Literals are short, so copy the lexeme
+    char buffer[64];
+    if (length < (int)sizeof(buffer))
+    {
+        memcpy(buffer, start, length);
+        buffer[length] = '\0';
+        return strtod(buffer, NULL);
+    }
+
+    char *heapBuffer = malloc(length + 1);
+    memcpy(heapBuffer, start, length);
+    heapBuffer[length] = '\0';
+    double value = strtod(heapBuffer, NULL);
+    free(heapBuffer);
+    return value;
+}
+
 static void compileNumberToken(bool canAssign)
 {
-    double value = strtod(parser.previous.start, NULL);
+    double value = parseNumber(context->parser.previous.start, context->parser.previous.length);
     emitConstant(NUMBER_VAL(value));
 }
 
@@ -395,9 +630,15 @@ static void or_(bool canAssign)
 
 static void string(bool canAssign)
 {
+    if (context->isChecking)
+    {
+        emitConstant(NIL_VAL);
+        return;
+    }
+
     // the +1 and -2 are for trimming the quotation marks
-    emitConstant(OBJECT_VAL(copyString(parser.previous.start + 1,
-                                       parser.previous.length - 2)));
+    emitConstant(OBJECT_VAL(lockedCopyString(context->parser.previous.start + 1,
+                                             context->parser.previous.length - 2)));
 }
 
 static void namedVariable(Token name, bool canAssign)
@@ -405,7 +646,7 @@ static void namedVariable(Token name, bool canAssign)
     uint8_t getOp, setOp;
 
     // see if there is a local variable with the given name.
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(context->current, &name);
     if (arg != -1)
     {
         getOp = OP_GET_LOCAL;
@@ -434,15 +675,15 @@ static void namedVariable(Token name, bool canAssign)
 // record the existence of a local variable.
 static void declareVariable()
 {
-    if (current->scopeDepth == 0)
+    if (context->current->scopeDepth == 0)
         return;
-    Token *name = &parser.previous;
+    Token *name = &context->parser.previous;
 
     // throw error if there is an already existing variable with the same name in the current scope.
-    for (int i = current->localCount - 1; i >= 0; i--)
+    for (int i = context->current->localCount - 1; i >= 0; i--)
     {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth)
+        Local *local = &context->current->locals[i];
+        if (local->depth != -1 && local->depth < context->current->scopeDepth)
         {
             break;
         }
@@ -457,12 +698,12 @@ static void declareVariable()
 
 static void variable(bool canAssign)
 {
-    namedVariable(parser.previous, canAssign);
+    namedVariable(context->parser.previous, canAssign);
 }
 
 static void compileUnaryExpression(bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = context->parser.previous.type;
 
     // compile the operand
     parsePrecedence(PREC_UNARY);
@@ -481,6 +722,22 @@ static void compileUnaryExpression(bool canAssign)
     }
 }
 
+// yield value suspends the coroutine the function runs in. It evaluates to whatever the coroutine is resumed with
+static void yield(bool canAssign)
+{
+    if (context->current->functionType == TYPE_SCRIPT)
+    {
+        errorAtPrevious("Can't yield from top-level code.");
+    }
+
+    // a bare yield hands out nil
+    if (checkTokenType(TOKEN_SEMICOLON) || checkTokenType(TOKEN_RIGHT_PAREN))
+        emitByte(OP_NIL);
+    else
+        parsePrecedence(PREC_OR);
+    emitByte(OP_YIELD);
+}
+
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
@@ -520,6 +777,7 @@ ParseRule rules[] = {
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_YIELD] = {yield, NULL, PREC_NONE},
     [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
     [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
 };
@@ -528,7 +786,10 @@ ParseRule rules[] = {
 // returns index of that constant in the table
 static uint8_t identifierConstant(Token *name)
 {
-    return makeConstant(OBJECT_VAL(copyString(name->start, name->length)));
+    // a check doesn't intern anything
+    if (context->isChecking)
+        return makeConstant(NIL_VAL);
+    return makeConstant(OBJECT_VAL(lockedCopyString(name->start, name->length)));
 }
 
 static bool identifiersEqual(Token *a, Token *b)
@@ -562,12 +823,12 @@ static int resolveLocal(Compiler *compiler, Token *name)
 // add a local variable to the compiler's list of variables in the current scope.
 static void addLocal(Token name)
 {
-    if (current->localCount == UINT8_COUNT)
+    if (context->current->localCount == UINT8_COUNT)
     {
         errorAtCurrent("Too many local variables in a function.");
         return;
     }
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &context->current->locals[context->current->localCount++];
     local->name = name;
     local->depth = -1; // initial depth of -1 when the local is in a special temporary 'uninitialized' state.
 }
@@ -579,25 +840,25 @@ static uint8_t parseVariable(const char *errorMessage)
     declareVariable();
     // if we are in a local scope, no need to add variable to contant table.
     // just return a dummy table index.
-    if (current->scopeDepth > 0)
+    if (context->current->scopeDepth > 0)
         return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierConstant(&context->parser.previous);
 }
 
 static void markInitialized()
 {
     // make sure we are in a local scope
-    if (current->scopeDepth == 0)
+    if (context->current->scopeDepth == 0)
         return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    context->current->locals[context->current->localCount - 1].depth = context->current->scopeDepth;
 }
 
 static void defineVariable(uint8_t global)
 {
     // if we are in local scope, don't emit code to create variable.
     // because the local variable has been allocated at the top of the stack.
-    if (current->scopeDepth > 0)
+    if (context->current->scopeDepth > 0)
     {
         // mark the local variable as initialized
         markInitialized();
@@ -647,11 +908,9 @@ static void expression()
     parsePrecedence(PREC_ASSIGNMENT);
 }
 
-// compiles a function
-static void function(FunctionType type)
+// compiles the parameter list and the body of the current function
+static void functionBody()
 {
-    Compiler compiler;
-    initCompiler(&compiler, type);
     beginScope();
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -659,8 +918,8 @@ static void function(FunctionType type)
     {
         do
         {
-            current->function->arity++;
-            if (current->function->arity > 255)
+            context->current->function->arity++;
+            if (context->current->function->arity > 255)
             {
                 errorAtCurrent("Can't have more than 255 parameters in a function.");
             }
@@ -672,8 +931,92 @@ static void function(FunctionType type)
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
+}
+
+#ifdef LAZY_COMPILE
+/*
+parses the parameters and the body of a function like functionBody() does, and reports the same errors,
+but emits no code and allocates nothing. The chunk of a scratch function only counts code and constants.
+functions declared in the body are checked along with it
+*/
+static void checkFunctionBody()
+{
+    bool wasChecking = context->isChecking;
+    context->isChecking = true;
+
+    FunctionObject function;
+    memset(&function, 0, sizeof(FunctionObject));
+    initChunk(&function.chunk);
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION, &function);
+    functionBody();
+
+    context->current = compiler.enclosing;
+    context->isChecking = wasChecking;
+}
+
+// instead of compiling the body now, keep a copy of its source for compileFunction().
+// the body is checked first, so its syntax errors are reported now and not once it is called.
+// the copy is needed because the REPL reuses its line buffer
+static bool deferFunction(FunctionObject *function)
+{
+    // the current token is the '(' of the parameter list, the scanner sits right behind it
+    if (!checkTokenType(TOKEN_LEFT_PAREN))
+        return false;
+
+    const char *start = context->parser.current.start;
+    int line = context->parser.current.line;
+    const char *end;
+    if (context->isSourceChecked)
+    {
+        end = skipFunctionBody(&context->scanner);
+        if (end == NULL)
+            return false;
+        // pick up parsing after the closing '}'
+        advance();
+    }
+    else
+    {
+        checkFunctionBody();
+        end = context->parser.previous.start + context->parser.previous.length;
+    }
+
+    function->sourceLength = (int)(end - start);
+    lockHeap(context->vm);
+    function->source = ALLOCATE(context->vm, char, function->sourceLength + 1);
+    unlockHeap(context->vm);
+    memcpy(function->source, start, function->sourceLength);
+    function->source[function->sourceLength] = '\0';
+    function->sourceLine = line;
+    return true;
+}
+#endif
+
+// compiles a function
+static void function(FunctionType type)
+{
+#ifdef LAZY_COMPILE
+    if (context->isChecking)
+    {
+        checkFunctionBody();
+        emitConstant(NIL_VAL);
+        return;
+    }
+#endif
+
+    FunctionObject *function = lockedNewFunction();
+    function->name = lockedCopyString(context->parser.previous.start, context->parser.previous.length);
+
+#ifdef LAZY_COMPILE
+    if (!deferFunction(function))
+#endif
+    {
+        Compiler compiler;
+        initCompiler(&compiler, type, function);
+        functionBody();
+        endCompiler();
+    }
 
-    FunctionObject *function = endCompiler();
     emitBytes(OP_CONSTANT, makeConstant(OBJECT_VAL(function)));
 }
 
@@ -810,7 +1153,7 @@ static void printStatement()
 
 static void returnStatement()
 {
-    if (current->functionType == TYPE_SCRIPT)
+    if (context->current->functionType == TYPE_SCRIPT)
     {
         errorAtCurrent("Can't return from top-level code");
     }
@@ -845,16 +1188,16 @@ static void whileStatement()
 
 static void synchronize()
 {
-    parser.panicMode = false;
+    context->parser.panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF)
+    while (context->parser.current.type != TOKEN_EOF)
     {
         // found a statement boundary
-        if (parser.previous.type == TOKEN_SEMICOLON)
+        if (context->parser.previous.type == TOKEN_SEMICOLON)
             return;
 
         // keep skipping tokens until you find a statement boundary
-        switch (parser.current.type)
+        switch (context->parser.current.type)
         {
         case TOKEN_CLASS:
         case TOKEN_FUN:
@@ -888,7 +1231,7 @@ static void declaration()
     {
         statement();
     }
-    if (parser.panicMode)
+    if (context->parser.panicMode)
         synchronize();
 }
 
@@ -935,15 +1278,38 @@ static void grouping(bool canAssign)
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-FunctionObject *compileCode(const char *sourceCode)
+// makes context the one compiling on this thread. Returns the context it replaces
+static CompileContext *beginContext(CompileContext *newContext, VM *vm, const char *sourceCode, int line)
 {
-    initScanner(sourceCode);
+    CompileContext *enclosing = context;
+    context = newContext;
+    context->vm = vm;
+    initScanner(&context->scanner, sourceCode, line);
+    initArena(&context->arena);
+    context->current = NULL;
+    context->isChecking = false;
+    context->isSourceChecked = false;
+    context->parser.hadError = false;
+    context->parser.panicMode = false;
+    return enclosing;
+}
 
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+// releases the context and puts back the one it replaced. Returns false if there was a compile error
+static bool endContext(CompileContext *enclosing)
+{
+    bool hadError = context->parser.hadError;
+    freeArena(&context->arena);
+    context = enclosing;
+    return !hadError;
+}
+
+FunctionObject *compileCode(VM *vm, const char *sourceCode)
+{
+    CompileContext compileContext;
+    CompileContext *enclosing = beginContext(&compileContext, vm, sourceCode, 1);
 
-    parser.hadError = false;
-    parser.panicMode = false;
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_SCRIPT, lockedNewFunction());
 
     advance();
 
@@ -953,5 +1319,114 @@ FunctionObject *compileCode(const char *sourceCode)
     }
 
     FunctionObject *function = endCompiler();
-    return parser.hadError ? NULL : function;
-}
\ No newline at end of file
+    return endContext(enclosing) ? function : NULL;
+}
+
+typedef struct
+{
+    VM *vm;
+    const char **sources;
+    FunctionObject **functions;
+    int count;
+    atomic_int next; // index of the next source no thread has picked up yet
+} CompileJobs;
+
+static void *compileWorker(void *argument)
+{
+    CompileJobs *jobs = (CompileJobs *)argument;
+    for (;;)
+    {
+        int i = atomic_fetch_add(&jobs->next, 1);
+        if (i >= jobs->count)
+            return NULL;
+        jobs->functions[i] = compileCode(jobs->vm, jobs->sources[i]);
+    }
+}
+
+bool compileSources(VM *vm, const char **sources, int count, FunctionObject **functions)
+{
+    CompileJobs jobs;
+    jobs.vm = vm;
+    jobs.sources = sources;
+    jobs.functions = functions;
+    jobs.count = count;
+    atomic_init(&jobs.next, 0);
+
+    // one thread per core at most. The calling thread compiles too
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadCount = count;
+    if (threadCount > cores)
+        threadCount = (int)cores;
+    if (threadCount > MAX_COMPILE_THREADS)
+        threadCount = MAX_COMPILE_THREADS;
+
+    pthread_t threads[MAX_COMPILE_THREADS];
+    int started = 0;
+    while (started < threadCount - 1 && pthread_create(&threads[started], NULL, compileWorker, &jobs) == 0)
+        started++;
+
+    compileWorker(&jobs);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    bool succeeded = true;
+    for (int i = 0; i < count; i++)
+    {
+        if (functions[i] == NULL)
+            succeeded = false;
+    }
+    return succeeded;
+}
+
+#ifdef LAZY_COMPILE
+bool compileFunction(VM *vm, FunctionObject *function)
+{
+    // the constants belong to the function, which may have to outlive the active region
+    bool isRegionActive = vm->region.isActive;
+    vm->region.isActive = isRegionActive && function->object.isRegion;
+    Object *newest = vm->objects;
+
+    CompileContext compileContext;
+    CompileContext *enclosing = beginContext(&compileContext, vm, function->source, function->sourceLine);
+    compileContext.isSourceChecked = true;
+
+    function->arity = 0;
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION, function);
+
+    advance();
+    functionBody();
+    consume(TOKEN_EOF, "Expect end of function body.");
+    endCompiler();
+
+    lockHeap(vm);
+    bool succeeded = endContext(enclosing);
+    if (succeeded)
+    {
+        FREE_ARRAY(vm, char, function->source, function->sourceLength + 1);
+        function->source = NULL;
+    }
+    else
+    {
+        // keep the source around, so a later call reports the error again
+        freeChunk(vm, &function->chunk);
+        initChunk(&function->chunk);
+    }
+    unlockHeap(vm);
+    vm->region.isActive = isRegionActive;
+
+    // a frozen function isn't traced, so whatever its body refers to has to be permanent as well
+    if (succeeded && function->object.isFrozen)
+    {
+        for (Object *object = vm->objects; object != newest; object = object->next)
+            object->isFrozen = true;
+    }
+
+#ifdef LINK_CODE_SEGMENTS
+    // the functions declared in the body haven't been compiled yet, so only the body itself is linked
+    if (succeeded)
+        linkProgram(vm, function);
+#endif
+    return succeeded;
+}
+#endif
@@ -5,6 +5,18 @@
 #include "vm.h"
 
 // compile source code and fill the chunk with bytecode
-FunctionObject *compileCode(const char *sourceCode);
+FunctionObject *compileCode(VM *vm, const char *sourceCode);
+
+#define MAX_COMPILE_THREADS 64
+
+// compiles independent sources at the same time, on up to one thread per core.
+// functions[i] receives the script function of sources[i], or NULL if it had errors.
+// returns false if any source had errors
+bool compileSources(VM *vm, const char **sources, int count, FunctionObject **functions);
+
+#ifdef LAZY_COMPILE
+// compiles the body of a function that was deferred by compileCode. Returns false on a compile error
+bool compileFunction(VM *vm, FunctionObject *function);
+#endif
 
 #endif
\ No newline at end of file
@@ -3,19 +3,19 @@
 #include "debug.h"
 #include "value.h"
 
-void disassembleChunk(Chunk *chunk, const char *name)
+void disassembleChunk(VM *vm, Chunk *chunk, const char *name)
 {
     printf("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;)
     {
         // dissasembleInstruction() will also provide us the offset of the beginning of next instruction
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 }
 
 // disassembles a single instruction
-int disassembleInstruction(Chunk *chunk, int offset)
+int disassembleInstruction(VM *vm, Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
 
@@ -32,7 +32,7 @@ int disassembleInstruction(Chunk *chunk, int offset)
     switch (instruction)
     {
     case OP_CONSTANT:
-        return constantInstruction("OP_CONSTANT", chunk, offset);
+        return constantInstruction(vm, "OP_CONSTANT", chunk, offset);
     case OP_NIL:
         return simpleInstruction("OP_NIL", offset);
     case OP_FALSE:
@@ -47,6 +47,8 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return simpleInstruction("OP_LESS", offset);
     case OP_ADD:
         return simpleInstruction("OP_ADD", offset);
+    case OP_ADD_N:
+        return byteInstruction("OP_ADD_N", chunk, offset);
     case OP_SUBTRACT:
         return simpleInstruction("OP_SUBTRACT", offset);
     case OP_MULTIPLY:
@@ -66,9 +68,9 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_SET_LOCAL:
         return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return constantInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return constantInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
     case OP_JUMP:
         return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
@@ -79,6 +81,8 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return byteInstruction("OP_CALL", chunk, offset);
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
+    case OP_YIELD:
+        return simpleInstruction("OP_YIELD", offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
@@ -99,11 +103,11 @@ static jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
 }
 
-static int constantInstruction(const char *name, Chunk *chunk, int offset)
+static int constantInstruction(VM *vm, const char *name, Chunk *chunk, int offset)
 {
     uint8_t constantIndex = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constantIndex);
-    printValue(chunk->constants.values[constantIndex]);
+    printValue(vm, chunk->constants.values[constantIndex]);
     printf("' \n");
     return offset + 2; // OP_CONSTANT instruction is 2 bytes
 }
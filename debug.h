@@ -3,7 +3,7 @@
 
 #include "chunk.h"
 
-void disassembleChunk(Chunk* chunk, const char* name);
-int dissasembleInstruction(Chunk* chunk, int offset);
+void disassembleChunk(VM *vm, Chunk* chunk, const char* name);
+int dissasembleInstruction(VM *vm, Chunk* chunk, int offset);
 
 #endif
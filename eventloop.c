@@ -0,0 +1,699 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4() and pipe2()
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+#include "memory.h"
+#include "vm.h"
+
+// how much a single read() hands back at most
+#define READ_SIZE (16 * 1024)
+
+#define EPOLL_BATCH 64
+
+static uint64_t nowNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// the loop's tables aren't part of the program's heap, so they are managed with plain realloc like the gray stack
+static void *growTable(void *table, int *capacity, int needed, size_t entrySize)
+{
+    if (needed <= *capacity)
+        return table;
+
+    int newCapacity = GROW_CAPACITY(*capacity);
+    if (newCapacity < needed)
+        newCapacity = needed;
+    table = realloc(table, entrySize * newCapacity);
+    if (table == NULL)
+        exit(1);
+    *capacity = newCapacity;
+    return table;
+}
+
+void initEventLoop(EventLoop *loop)
+{
+    loop->epollFd = -1;
+    loop->timerFd = -1;
+    loop->fds = NULL;
+    loop->fdCapacity = 0;
+    loop->timers = NULL;
+    loop->timerCount = 0;
+    loop->timerCapacity = 0;
+    loop->ready = NULL;
+    loop->readyCount = 0;
+    loop->readyCapacity = 0;
+    loop->taskCount = 0;
+    loop->waitCount = 0;
+    loop->suspendTask = false;
+    loop->taskWaits = false;
+}
+
+static bool startEventLoop(EventLoop *loop)
+{
+    if (loop->epollFd >= 0)
+        return true;
+
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epollFd < 0)
+        return false;
+
+    loop->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = loop->timerFd};
+    if (loop->timerFd < 0 || epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->timerFd, &event) < 0)
+    {
+        close(loop->epollFd);
+        loop->epollFd = -1;
+        return false;
+    }
+    return true;
+}
+
+static FdState *fdState(EventLoop *loop, int fd)
+{
+    if (fd >= loop->fdCapacity)
+    {
+        int oldCapacity = loop->fdCapacity;
+        loop->fds = growTable(loop->fds, &loop->fdCapacity, fd + 1, sizeof(FdState));
+        for (int i = oldCapacity; i < loop->fdCapacity; i++)
+        {
+            FdState *state = &loop->fds[i];
+            state->reader.task = NULL;
+            state->writer.task = NULL;
+            state->events = 0;
+            state->isOwned = false;
+            state->peer = -1;
+        }
+    }
+    return &loop->fds[fd];
+}
+
+// registers a file descriptor that a native just created
+static int ownFd(EventLoop *loop, int fd)
+{
+    if (fd >= 0)
+        fdState(loop, fd)->isOwned = true;
+    return fd;
+}
+
+// keeps the epoll registration in line with who waits on the fd. An fd nobody waits for is
+// removed entirely, otherwise a hangup would keep waking the loop up
+static void updateInterest(EventLoop *loop, int fd)
+{
+    FdState *state = &loop->fds[fd];
+    uint32_t events = (state->reader.task != NULL ? EPOLLIN : 0) | (state->writer.task != NULL ? EPOLLOUT : 0);
+    if (events == state->events)
+        return;
+
+    struct epoll_event event = {.events = events, .data.fd = fd};
+    if (events == 0)
+        epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    else
+        epoll_ctl(loop->epollFd, state->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+    state->events = events;
+}
+
+static void readyTask(EventLoop *loop, CoroutineObject *task, Value value)
+{
+    loop->ready = growTable(loop->ready, &loop->readyCapacity, loop->readyCount + 1, sizeof(ReadyTask));
+    loop->ready[loop->readyCount].task = task;
+    loop->ready[loop->readyCount].value = value;
+    loop->readyCount++;
+}
+
+void addTask(VM *vm, CoroutineObject *task)
+{
+    vm->loop.taskCount++;
+    readyTask(&vm->loop, task, NIL_VAL);
+}
+
+static void armTimer(EventLoop *loop)
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (loop->timerCount > 0)
+    {
+        // an absolute time of zero would disarm the timer
+        uint64_t deadline = loop->timers[0].deadline > 0 ? loop->timers[0].deadline : 1;
+        spec.it_value.tv_sec = deadline / 1000000000u;
+        spec.it_value.tv_nsec = deadline % 1000000000u;
+    }
+    timerfd_settime(loop->timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void pushTimer(EventLoop *loop, Timer timer)
+{
+    loop->timers = growTable(loop->timers, &loop->timerCapacity, loop->timerCount + 1, sizeof(Timer));
+
+    int i = loop->timerCount++;
+    while (i > 0 && loop->timers[(i - 1) / 2].deadline > timer.deadline)
+    {
+        loop->timers[i] = loop->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    loop->timers[i] = timer;
+
+    if (i == 0)
+        armTimer(loop);
+}
+
+static Timer popTimer(EventLoop *loop)
+{
+    Timer first = loop->timers[0];
+    Timer last = loop->timers[--loop->timerCount];
+
+    int i = 0;
+    for (;;)
+    {
+        int child = i * 2 + 1;
+        if (child >= loop->timerCount)
+            break;
+        if (child + 1 < loop->timerCount && loop->timers[child + 1].deadline < loop->timers[child].deadline)
+            child++;
+        if (last.deadline <= loop->timers[child].deadline)
+            break;
+        loop->timers[i] = loop->timers[child];
+        i = child;
+    }
+    if (loop->timerCount > 0)
+        loop->timers[i] = last;
+    return first;
+}
+
+static void expireTimers(EventLoop *loop)
+{
+    uint64_t expirations;
+    while (read(loop->timerFd, &expirations, sizeof(expirations)) > 0)
+        ;
+
+    uint64_t now = nowNanos();
+    while (loop->timerCount > 0 && loop->timers[0].deadline <= now)
+    {
+        Timer timer = popTimer(loop);
+        loop->waitCount--;
+        readyTask(loop, timer.task, NIL_VAL);
+    }
+    armTimer(loop);
+}
+
+/*
+reads or writes without blocking. The fds our natives created are non-blocking already. Others, like stdin,
+share their flags with whoever else has them open, the parent shell for one, so they are left alone:
+sockets get MSG_DONTWAIT, anything else is only made non-blocking for the length of the call
+*/
+static ssize_t transfer(EventLoop *loop, int fd, bool isWrite, void *buffer, size_t length)
+{
+    if (fd < loop->fdCapacity && loop->fds[fd].isOwned)
+        return isWrite ? write(fd, buffer, length) : read(fd, buffer, length);
+
+    ssize_t count = isWrite ? send(fd, buffer, length, MSG_DONTWAIT) : recv(fd, buffer, length, MSG_DONTWAIT);
+    if (count >= 0 || errno != ENOTSOCK)
+        return count;
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return -1;
+    if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    count = isWrite ? write(fd, buffer, length) : read(fd, buffer, length);
+    int error = errno;
+    if (!(flags & O_NONBLOCK))
+        fcntl(fd, F_SETFL, flags);
+    errno = error;
+    return count;
+}
+
+/*
+performs the waiter's operation without blocking. Returns false if the fd isn't ready for it yet,
+otherwise stores what the task gets back in result: the data read, the number of bytes written,
+the new or connected socket, or nil on end of file and on errors.
+*/
+static bool tryOperation(VM *vm, int fd, Waiter *waiter, Value *result)
+{
+    *result = NIL_VAL;
+    switch (waiter->type)
+    {
+    case WAIT_READ:
+    {
+        char buffer[READ_SIZE];
+        ssize_t count;
+        do
+            count = transfer(&vm->loop, fd, false, buffer, sizeof(buffer));
+        while (count < 0 && errno == EINTR);
+
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        if (count > 0)
+            *result = OBJECT_VAL(copyString(vm, buffer, (int)count));
+        return true;
+    }
+    case WAIT_WRITE:
+    {
+        int length;
+        const char *chars = stringChars(vm, AS_OBJECT(waiter->data), &length);
+        while (waiter->written < length)
+        {
+            ssize_t count = transfer(&vm->loop, fd, true, (char *)chars + waiter->written, length - waiter->written);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return false;
+            if (count < 0)
+                return true;
+            waiter->written += (int)count;
+        }
+        *result = NUMBER_VAL(waiter->written);
+        return true;
+    }
+    case WAIT_ACCEPT:
+    {
+        int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return false;
+        if (client >= 0)
+            *result = NUMBER_VAL(ownFd(&vm->loop, client));
+        return true;
+    }
+    case WAIT_CONNECT:
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0)
+            *result = NUMBER_VAL(fd);
+        return true;
+    }
+    }
+    return true;
+}
+
+static bool inTask(VM *vm)
+{
+    return vm->coroutine != NULL && vm->coroutine->isTask;
+}
+
+/*
+runs the operation right away if the fd is ready. Otherwise the running task is parked on the fd
+and suspended once the native returns. The event loop resumes it with the result later.
+outside of tasks, nothing can wait, so an operation that isn't ready returns nil.
+*/
+static Value performOrWait(VM *vm, int fd, WaitType type, Value data)
+{
+    Waiter attempt = {.task = NULL, .type = type, .data = data, .written = 0};
+    Value result;
+    if (tryOperation(vm, fd, &attempt, &result))
+        return result;
+
+    EventLoop *loop = &vm->loop;
+    if (!inTask(vm) || !startEventLoop(loop))
+        return NIL_VAL;
+
+    FdState *state = fdState(loop, fd);
+    Waiter *waiter = type == WAIT_READ || type == WAIT_ACCEPT ? &state->reader : &state->writer;
+    if (waiter->task != NULL)
+        return NIL_VAL; // another task already waits for the same thing
+
+    *waiter = attempt;
+    waiter->task = vm->coroutine;
+    updateInterest(loop, fd);
+    if (state->events == 0)
+    {
+        // epoll refuses some fds, like regular files, which never block anyway
+        waiter->task = NULL;
+        return NIL_VAL;
+    }
+
+    loop->waitCount++;
+    loop->suspendTask = true;
+    loop->taskWaits = true;
+    return NIL_VAL;
+}
+
+static bool isFd(Value value)
+{
+    return IS_NUMBER(value) && AS_NUMBER(value) >= 0 && AS_NUMBER(value) <= INT32_MAX;
+}
+
+// read(fd) returns the next data available on fd, waiting for it if needed, or nil at the end
+static Value readNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !isFd(args[0]))
+        return NIL_VAL;
+    return performOrWait(vm, (int)AS_NUMBER(args[0]), WAIT_READ, NIL_VAL);
+}
+
+// write(fd, string) writes all of the string and returns how many bytes that was, or nil on errors
+static Value writeNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 2 || !isFd(args[0]) || !IS_ANY_STRING(args[1]))
+        return NIL_VAL;
+    return performOrWait(vm, (int)AS_NUMBER(args[0]), WAIT_WRITE, args[1]);
+}
+
+// close(fd) closes the fd. Tasks waiting on it get nil
+static Value closeNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !isFd(args[0]))
+        return NIL_VAL;
+
+    int fd = (int)AS_NUMBER(args[0]);
+    EventLoop *loop = &vm->loop;
+    if (fd < loop->fdCapacity)
+    {
+        FdState *state = &loop->fds[fd];
+        Waiter *waiters[] = {&state->reader, &state->writer};
+        for (int i = 0; i < 2; i++)
+        {
+            if (waiters[i]->task == NULL)
+                continue;
+            readyTask(loop, waiters[i]->task, NIL_VAL);
+            waiters[i]->task = NULL;
+            loop->waitCount--;
+        }
+        updateInterest(loop, fd);
+
+        if (state->peer >= 0 && state->peer < loop->fdCapacity)
+            loop->fds[state->peer].peer = -1;
+        state->peer = -1;
+        state->isOwned = false;
+    }
+    return BOOL_VAL(close(fd) == 0);
+}
+
+// sleep(milliseconds) suspends the task for at least that long
+static Value sleepNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_NUMBER(args[0]) || !inTask(vm))
+        return NIL_VAL;
+
+    EventLoop *loop = &vm->loop;
+    if (AS_NUMBER(args[0]) <= 0)
+    {
+        // nothing to wait for, just let the other tasks run first
+        readyTask(loop, vm->coroutine, NIL_VAL);
+    }
+    else
+    {
+        if (!startEventLoop(loop))
+            return NIL_VAL;
+        Timer timer = {.deadline = nowNanos() + (uint64_t)(AS_NUMBER(args[0]) * 1e6), .task = vm->coroutine};
+        pushTimer(loop, timer);
+        loop->waitCount++;
+    }
+
+    loop->suspendTask = true;
+    loop->taskWaits = true;
+    return NIL_VAL;
+}
+
+static Value pairFds(VM *vm, int fds[2])
+{
+    EventLoop *loop = &vm->loop;
+    ownFd(loop, fds[0]);
+    ownFd(loop, fds[1]);
+    loop->fds[fds[0]].peer = fds[1];
+    loop->fds[fds[1]].peer = fds[0];
+    return NUMBER_VAL(fds[0]);
+}
+
+// pipe() returns the read end of a new pipe. peer() gives the write end
+static Value pipeNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 0)
+        return NIL_VAL;
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+        return NIL_VAL;
+    return pairFds(vm, fds);
+}
+
+// socketPair() returns one end of a pair of connected Unix sockets. peer() gives the other end
+static Value socketPairNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 0)
+        return NIL_VAL;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+        return NIL_VAL;
+    return pairFds(vm, fds);
+}
+
+// peer(fd) returns the other end of a pipe or socket pair
+static Value peerNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !isFd(args[0]) || AS_NUMBER(args[0]) >= vm->loop.fdCapacity)
+        return NIL_VAL;
+
+    int peer = vm->loop.fds[(int)AS_NUMBER(args[0])].peer;
+    return peer >= 0 ? NUMBER_VAL(peer) : NIL_VAL;
+}
+
+static bool unixAddress(VM *vm, Value path, struct sockaddr_un *address)
+{
+    if (!IS_ANY_STRING(path))
+        return false;
+
+    int length;
+    const char *chars = stringChars(vm, AS_OBJECT(path), &length);
+    if (length == 0 || length >= (int)sizeof(address->sun_path))
+        return false;
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, chars, length);
+    return true;
+}
+
+// listen(path) returns a Unix socket listening at path
+static Value listenNative(VM *vm, int argCount, Value *args)
+{
+    struct sockaddr_un address;
+    if (argCount != 1 || !unixAddress(vm, args[0], &address))
+        return NIL_VAL;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NIL_VAL;
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        close(fd);
+        return NIL_VAL;
+    }
+    return NUMBER_VAL(ownFd(&vm->loop, fd));
+}
+
+// accept(fd) waits for the next connection on a listening socket and returns its fd
+static Value acceptNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !isFd(args[0]))
+        return NIL_VAL;
+    return performOrWait(vm, (int)AS_NUMBER(args[0]), WAIT_ACCEPT, NIL_VAL);
+}
+
+// connect(path) connects to the Unix socket at path and returns the connected fd
+static Value connectNative(VM *vm, int argCount, Value *args)
+{
+    struct sockaddr_un address;
+    if (argCount != 1 || !unixAddress(vm, args[0], &address))
+        return NIL_VAL;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NIL_VAL;
+    ownFd(&vm->loop, fd);
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+        return NUMBER_VAL(fd);
+    if (errno != EINPROGRESS && errno != EAGAIN)
+    {
+        vm->loop.fds[fd].isOwned = false;
+        close(fd);
+        return NIL_VAL;
+    }
+    return performOrWait(vm, fd, WAIT_CONNECT, NIL_VAL);
+}
+
+void defineEventLoopNatives(VM *vm)
+{
+    defineNative(vm, "read", readNative);
+    defineNative(vm, "write", writeNative);
+    defineNative(vm, "close", closeNative);
+    defineNative(vm, "sleep", sleepNative);
+    defineNative(vm, "pipe", pipeNative);
+    defineNative(vm, "socketPair", socketPairNative);
+    defineNative(vm, "peer", peerNative);
+    defineNative(vm, "listen", listenNative);
+    defineNative(vm, "accept", acceptNative);
+    defineNative(vm, "connect", connectNative);
+}
+
+// retries the operations of whoever waits on a ready fd, and queues the tasks that are done
+static void wakeWaiters(VM *vm, int fd, uint32_t events)
+{
+    EventLoop *loop = &vm->loop;
+    if (fd >= loop->fdCapacity)
+        return;
+
+    bool failed = events & (EPOLLERR | EPOLLHUP);
+    bool isReady[] = {events & EPOLLIN || failed, events & EPOLLOUT || failed};
+    for (int i = 0; i < 2; i++)
+    {
+        // accepting a connection can grow the fd table, so the waiter is looked up again afterwards
+        Waiter *waiter = i == 0 ? &loop->fds[fd].reader : &loop->fds[fd].writer;
+        Value result;
+        if (waiter->task == NULL || !isReady[i] || !tryOperation(vm, fd, waiter, &result))
+            continue;
+
+        waiter = i == 0 ? &loop->fds[fd].reader : &loop->fds[fd].writer;
+        readyTask(loop, waiter->task, result);
+        waiter->task = NULL;
+        loop->waitCount--;
+    }
+    updateInterest(loop, fd);
+}
+
+// resumes the tasks that were ready when it was called, in order. Tasks they wake up run in the next round
+static bool runReadyTasks(VM *vm)
+{
+    EventLoop *loop = &vm->loop;
+    int count = loop->readyCount;
+    for (int i = 0; i < count; i++)
+    {
+        ReadyTask ready = loop->ready[i];
+        loop->taskWaits = false;
+        if (resumeTask(vm, ready.task, ready.value) != INTERPRET_OK)
+            return false;
+
+        // a task that only yielded goes to the back of the queue
+        if (ready.task->state == COROUTINE_DONE)
+            loop->taskCount--;
+        else if (!loop->taskWaits)
+            readyTask(loop, ready.task, NIL_VAL);
+    }
+
+    loop->readyCount -= count;
+    memmove(loop->ready, loop->ready + count, sizeof(ReadyTask) * loop->readyCount);
+    return true;
+}
+
+bool runEventLoop(VM *vm)
+{
+    EventLoop *loop = &vm->loop;
+    while (loop->taskCount > 0)
+    {
+        if (loop->readyCount > 0)
+        {
+            if (!runReadyTasks(vm))
+            {
+                resetEventLoop(vm);
+                return false;
+            }
+            continue;
+        }
+
+        // whatever the remaining tasks wait for can't happen anymore
+        if (loop->waitCount == 0)
+            break;
+
+        // show what the tasks printed so far before blocking, maybe for a long time
+        flushOutput(&vm->output);
+
+        struct epoll_event events[EPOLL_BATCH];
+        int count = epoll_wait(loop->epollFd, events, EPOLL_BATCH, -1);
+        if (count < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.fd == loop->timerFd)
+                expireTimers(loop);
+            else
+                wakeWaiters(vm, events[i].data.fd, events[i].events);
+        }
+    }
+
+    resetEventLoop(vm);
+    return true;
+}
+
+void markEventLoop(VM *vm)
+{
+    EventLoop *loop = &vm->loop;
+    for (int i = 0; i < loop->readyCount; i++)
+    {
+        markObject(vm, (Object *)loop->ready[i].task);
+        markValue(vm, loop->ready[i].value);
+    }
+    for (int i = 0; i < loop->timerCount; i++)
+        markObject(vm, (Object *)loop->timers[i].task);
+    for (int i = 0; i < loop->fdCapacity; i++)
+    {
+        FdState *state = &loop->fds[i];
+        markObject(vm, (Object *)state->reader.task);
+        if (state->writer.task != NULL)
+        {
+            markObject(vm, (Object *)state->writer.task);
+            markValue(vm, state->writer.data);
+        }
+    }
+}
+
+void resetEventLoop(VM *vm)
+{
+    EventLoop *loop = &vm->loop;
+    for (int i = 0; i < loop->fdCapacity; i++)
+    {
+        FdState *state = &loop->fds[i];
+        state->reader.task = NULL;
+        state->writer.task = NULL;
+        if (state->events != 0)
+            epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, i, NULL);
+        state->events = 0;
+    }
+
+    loop->timerCount = 0;
+    if (loop->timerFd >= 0)
+        armTimer(loop);
+    loop->readyCount = 0;
+    loop->taskCount = 0;
+    loop->waitCount = 0;
+    loop->suspendTask = false;
+    loop->taskWaits = false;
+}
+
+void freeEventLoop(VM *vm)
+{
+    EventLoop *loop = &vm->loop;
+    resetEventLoop(vm);
+
+    for (int i = 0; i < loop->fdCapacity; i++)
+    {
+        if (loop->fds[i].isOwned)
+            close(i);
+    }
+    if (loop->epollFd >= 0)
+    {
+        close(loop->timerFd);
+        close(loop->epollFd);
+    }
+
+    free(loop->fds);
+    free(loop->timers);
+    free(loop->ready);
+    initEventLoop(loop);
+}
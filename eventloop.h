@@ -0,0 +1,91 @@
+#ifndef clox_eventloop_h
+#define clox_eventloop_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// what a task waits for on a file descriptor
+typedef enum
+{
+    WAIT_READ,
+    WAIT_WRITE,
+    WAIT_ACCEPT,
+    WAIT_CONNECT
+} WaitType;
+
+typedef struct
+{
+    CoroutineObject *task; // NULL if nobody waits
+    WaitType type;
+    Value data;  // WAIT_WRITE: the string being written
+    int written; // WAIT_WRITE: how much of it is out already
+} Waiter;
+
+typedef struct
+{
+    Waiter reader; // WAIT_READ or WAIT_ACCEPT
+    Waiter writer; // WAIT_WRITE or WAIT_CONNECT
+    uint32_t events; // what the fd is registered with epoll for, 0 if it isn't
+    bool isOwned;    // created by a native, so it is closed when the program's state is dropped
+    int peer;        // the other end of a pipe or socket pair, -1 otherwise
+} FdState;
+
+typedef struct
+{
+    uint64_t deadline; // CLOCK_MONOTONIC nanoseconds
+    CoroutineObject *task;
+} Timer;
+
+typedef struct
+{
+    CoroutineObject *task;
+    Value value; // what the task gets back for the operation it waited for
+} ReadyTask;
+
+/*
+runs tasks: coroutines started with spawn() that stop whenever they would block on I/O or a timer.
+all file descriptors are watched with one epoll instance and all timers share one timerfd,
+which is armed for the earliest deadline. Both are only created once a task first has to wait.
+*/
+typedef struct
+{
+    int epollFd;
+    int timerFd;
+
+    FdState *fds; // indexed by file descriptor
+    int fdCapacity;
+
+    Timer *timers; // a binary min-heap ordered by deadline
+    int timerCount;
+    int timerCapacity;
+
+    ReadyTask *ready; // tasks to resume, in order
+    int readyCount;
+    int readyCapacity;
+
+    int taskCount; // tasks that haven't finished yet
+    int waitCount; // tasks parked on a file descriptor or a timer
+    bool suspendTask; // set by a native that parked the running task. The VM suspends it once the native returns
+    bool taskWaits;   // the last resumed task parked itself somewhere, instead of just yielding
+} EventLoop;
+
+void initEventLoop(EventLoop *loop);
+
+// forgets every task. File descriptors stay open
+void resetEventLoop(VM *vm);
+
+// also closes the file descriptors natives created
+void freeEventLoop(VM *vm);
+
+void defineEventLoopNatives(VM *vm);
+
+// queues a freshly spawned task to run when the event loop runs next
+void addTask(VM *vm, CoroutineObject *task);
+
+// runs tasks until all of them have finished. Returns false if one of them hit a runtime error
+bool runEventLoop(VM *vm);
+
+void markEventLoop(VM *vm);
+
+#endif
@@ -0,0 +1,116 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "files.h"
+#include "object.h"
+
+// maps the regular file at path read-only. Returns NULL if that isn't possible
+static FileObject *mapFile(VM *vm, Value path)
+{
+    if (!IS_ANY_STRING(path))
+        return NULL;
+
+    int length;
+    const char *chars = stringChars(vm, AS_OBJECT(path), &length);
+    char terminated[PATH_MAX];
+    if (length == 0 || length >= PATH_MAX)
+        return NULL;
+    memcpy(terminated, chars, length);
+    terminated[length] = '\0';
+
+    int fd = open(terminated, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    // the mapping keeps the file around, the descriptor isn't needed anymore
+    struct stat status;
+    void *mapped = NULL;
+    bool succeeded = fstat(fd, &status) == 0 && S_ISREG(status.st_mode);
+    if (succeeded && status.st_size > 0)
+    {
+        mapped = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        succeeded = mapped != MAP_FAILED;
+    }
+    close(fd);
+    if (!succeeded)
+        return NULL;
+    return newFile(vm, (const char *)mapped, (size_t)status.st_size);
+}
+
+// a part of the file, passed the way substring() would pass it: long ones are slices, short ones copies
+static Value fileString(VM *vm, FileObject *file, const char *chars, int length)
+{
+    if (length < SLICE_MIN_LENGTH)
+        return OBJECT_VAL(copyString(vm, chars, length));
+    return OBJECT_VAL(newSlice(vm, (Object *)file, chars, length));
+}
+
+// readFile(path) returns the whole file as a string without copying it, or nil if it can't be mapped
+static Value readFileNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1)
+        return NIL_VAL;
+
+    FileObject *file = mapFile(vm, args[0]);
+    if (file == NULL || file->length > INT_MAX)
+        return NIL_VAL;
+    if (file->length == 0)
+        return OBJECT_VAL(copyString(vm, "", 0));
+    return fileString(vm, file, file->chars, (int)file->length);
+}
+
+// openFile(path) returns the file for readLine(), or nil if it can't be mapped
+static Value openFileNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1)
+        return NIL_VAL;
+
+    FileObject *file = mapFile(vm, args[0]);
+    if (file == NULL)
+        return NIL_VAL;
+
+    // read-ahead can go further, and pages behind the reader are dropped first
+    if (file->chars != NULL)
+        madvise((void *)file->chars, file->length, MADV_SEQUENTIAL);
+    return OBJECT_VAL(file);
+}
+
+// readLine(file) returns the next line without its '\n', or nil once the file is done
+static Value readLineNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_FILE(args[0]))
+        return NIL_VAL;
+
+    FileObject *file = AS_FILE(args[0]);
+    if (file->position >= file->length)
+        return NIL_VAL;
+
+    const char *chars = file->chars + file->position;
+    size_t rest = file->length - file->position;
+    const char *newline = memchr(chars, '\n', rest);
+    size_t length = newline != NULL ? (size_t)(newline - chars) : rest;
+    if (length > INT_MAX)
+        return NIL_VAL;
+    file->position += newline != NULL ? length + 1 : length;
+
+    // the pages a multi-gigabyte file has been read through would otherwise pile up. They are
+    // only clean copies of the file, so slices handed out before just read them in again
+    while (file->position - file->released >= FILE_RELEASE_SIZE)
+    {
+        madvise((void *)(file->chars + file->released), FILE_RELEASE_SIZE, MADV_DONTNEED);
+        file->released += FILE_RELEASE_SIZE;
+    }
+
+    return fileString(vm, file, chars, (int)length);
+}
+
+void defineFileNatives(VM *vm)
+{
+    defineNative(vm, "readFile", readFileNative);
+    defineNative(vm, "openFile", openFileNative);
+    defineNative(vm, "readLine", readLineNative);
+}
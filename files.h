@@ -0,0 +1,12 @@
+#ifndef clox_files_h
+#define clox_files_h
+
+#include "vm.h"
+
+// readLine() hands the pages it has gone past back to the kernel in steps of this many bytes
+#define FILE_RELEASE_SIZE (64 * 1024 * 1024)
+
+// readFile(path), openFile(path) and readLine(file). Files are mapped, never read into buffers
+void defineFileNatives(VM *vm);
+
+#endif
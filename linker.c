@@ -0,0 +1,246 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "linker.h"
+#include "memory.h"
+#include "vm.h"
+
+#define ALIGN_UP(size, alignment) (((size) + (alignment)-1) & ~((size_t)(alignment)-1))
+
+typedef struct
+{
+    int capacity;
+    int count;
+    FunctionObject **functions;
+} FunctionList;
+
+static void addFunction(VM *vm, FunctionList *list, FunctionObject *function)
+{
+    if (list->capacity < list->count + 1)
+    {
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->functions = GROW_ARRAY(vm, FunctionObject *, list->functions, oldCapacity, list->capacity);
+    }
+    list->functions[list->count++] = function;
+}
+
+/*
+orders functions by walking their nesting depth first from the script: the constants of a function hold the
+functions declared in its body, so each one is laid out right after the function it is declared in.
+functions that are already linked, still being compiled, or whose body hasn't been compiled
+yet are left alone.
+*/
+static void collectFunctions(VM *vm, FunctionList *list, FunctionObject *script)
+{
+    FunctionList pending = {0, 0, NULL};
+    addFunction(vm, &pending, script);
+
+    while (pending.count > 0)
+    {
+        FunctionObject *function = pending.functions[--pending.count];
+        if (function->chunk.isLinked || function->chunk.arena != NULL || function->source != NULL)
+            continue;
+        addFunction(vm, list, function);
+
+        // push in reverse so the first referenced function is visited first
+        ValueArray *constants = &function->chunk.constants;
+        for (int i = constants->count - 1; i >= 0; i--)
+        {
+            if (IS_FUNCTION(constants->values[i]))
+                addFunction(vm, &pending, AS_FUNCTION(constants->values[i]));
+        }
+    }
+
+    FREE_ARRAY(vm, FunctionObject *, pending.functions, pending.capacity);
+}
+
+static void *mapSegment(size_t size)
+{
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+    return memory;
+}
+
+static CodeSegment *newSegment(VM *vm, size_t codeSize, size_t dataSize)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    codeSize = ALIGN_UP(codeSize > 0 ? codeSize : 1, pageSize);
+    dataSize = ALIGN_UP(dataSize > 0 ? dataSize : 1, pageSize);
+
+    uint8_t *code = (uint8_t *)mapSegment(codeSize);
+    uint8_t *data = (uint8_t *)mapSegment(dataSize);
+    if (code == NULL || data == NULL)
+    {
+        if (code != NULL)
+            munmap(code, codeSize);
+        if (data != NULL)
+            munmap(data, dataSize);
+        return NULL;
+    }
+
+    CodeSegment *segment = ALLOCATE(vm, CodeSegment, 1);
+    segment->code = code;
+    segment->codeSize = codeSize;
+    segment->codeUsed = 0;
+    segment->data = data;
+    segment->dataSize = dataSize;
+    segment->constantsEnd = 0;
+    segment->linesStart = dataSize;
+    segment->functionCount = 0;
+    return segment;
+}
+
+static void freeCodeSegment(VM *vm, CodeSegment *segment)
+{
+    munmap(segment->code, segment->codeSize);
+    if (segment->data != NULL)
+        munmap(segment->data, segment->dataSize);
+    FREE(vm, CodeSegment, segment);
+}
+
+static bool protectSegment(CodeSegment *segment, int protection)
+{
+    return mprotect(segment->code, segment->codeSize, protection) == 0 &&
+           mprotect(segment->data, segment->dataSize, protection) == 0;
+}
+
+// the newest segment takes small links, like a REPL line, if it has room left. Snapshot images have no data and take nothing
+static bool reuseSegment(CodeSegment *segment, size_t codeSize, size_t dataSize)
+{
+    if (segment == NULL || segment->data == NULL)
+        return false;
+    if (segment->codeSize - segment->codeUsed < codeSize || segment->linesStart - segment->constantsEnd < dataSize)
+        return false;
+    if (protectSegment(segment, PROT_READ | PROT_WRITE))
+        return true;
+
+    protectSegment(segment, PROT_READ);
+    return false;
+}
+
+// takes the room for a chunk from the segment. Constants are a multiple of their own alignment
+// and the line numbers start from a page boundary, so both stay aligned
+static void placeChunk(CodeSegment *segment, Chunk *chunk, uint8_t **code, Value **constants, int **lines)
+{
+    *code = segment->code + segment->codeUsed;
+    segment->codeUsed += chunk->count * sizeof(uint8_t);
+
+    *constants = (Value *)(segment->data + segment->constantsEnd);
+    segment->constantsEnd += chunk->constants.count * sizeof(Value);
+
+    segment->linesStart -= chunk->count * sizeof(int);
+    *lines = (int *)(segment->data + segment->linesStart);
+}
+
+void linkProgram(VM *vm, FunctionObject *script)
+{
+    FunctionList list = {0, 0, NULL};
+    collectFunctions(vm, &list, script);
+    if (list.count == 0)
+        return;
+
+    // the code segment only holds bytecode, constants and line numbers go to the data segment
+    size_t codeSize = 0;
+    size_t dataSize = 0;
+    for (int i = 0; i < list.count; i++)
+    {
+        Chunk *chunk = &list.functions[i]->chunk;
+        codeSize += chunk->count * sizeof(uint8_t);
+        dataSize += chunk->constants.count * sizeof(Value) + chunk->count * sizeof(int);
+    }
+
+    bool isNew = !reuseSegment(vm->segments, codeSize, dataSize);
+    CodeSegment *segment = isNew ? newSegment(vm, codeSize, dataSize) : vm->segments;
+    if (segment == NULL)
+    {
+        // linking is only an optimization, the chunks keep working from the heap
+        FREE_ARRAY(vm, FunctionObject *, list.functions, list.capacity);
+        return;
+    }
+
+    size_t codeUsed = segment->codeUsed;
+    size_t constantsEnd = segment->constantsEnd;
+    size_t linesStart = segment->linesStart;
+    for (int i = 0; i < list.count; i++)
+    {
+        Chunk *chunk = &list.functions[i]->chunk;
+        uint8_t *code;
+        Value *constants;
+        int *lines;
+        placeChunk(segment, chunk, &code, &constants, &lines);
+
+        memcpy(code, chunk->code, chunk->count * sizeof(uint8_t));
+        memcpy(lines, chunk->lines, chunk->count * sizeof(int));
+        if (chunk->constants.count > 0)
+            memcpy(constants, chunk->constants.values, chunk->constants.count * sizeof(Value));
+    }
+
+    // the chunks only move once the copies are read-only. A new segment that can't be protected is dropped.
+    // code in a reused segment was writable for a moment anyway, so if it can't be protected again it stays as it is
+    if (!protectSegment(segment, PROT_READ) && isNew)
+    {
+        freeCodeSegment(vm, segment);
+        FREE_ARRAY(vm, FunctionObject *, list.functions, list.capacity);
+        return;
+    }
+
+    segment->codeUsed = codeUsed;
+    segment->constantsEnd = constantsEnd;
+    segment->linesStart = linesStart;
+    for (int i = 0; i < list.count; i++)
+    {
+        Chunk *chunk = &list.functions[i]->chunk;
+        uint8_t *code;
+        Value *constants;
+        int *lines;
+        placeChunk(segment, chunk, &code, &constants, &lines);
+
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+        FREE_ARRAY(vm, Value, chunk->constants.values, chunk->constants.capacity);
+
+        chunk->code = code;
+        chunk->lines = lines;
+        chunk->capacity = chunk->count;
+        chunk->constants.values = constants;
+        chunk->constants.capacity = chunk->constants.count;
+        chunk->isLinked = true;
+        chunk->segment = segment;
+    }
+
+    segment->functionCount += list.count;
+    if (isNew)
+    {
+        segment->next = vm->segments;
+        vm->segments = segment;
+    }
+
+    FREE_ARRAY(vm, FunctionObject *, list.functions, list.capacity);
+}
+
+void releaseCodeSegment(VM *vm, CodeSegment *segment)
+{
+    if (--segment->functionCount > 0)
+        return;
+
+    CodeSegment **link = &vm->segments;
+    while (*link != segment)
+        link = &(*link)->next;
+    *link = segment->next;
+    freeCodeSegment(vm, segment);
+}
+
+void freeCodeSegments(VM *vm)
+{
+    CodeSegment *segment = vm->segments;
+    while (segment != NULL)
+    {
+        CodeSegment *next = segment->next;
+        freeCodeSegment(vm, segment);
+        segment = next;
+    }
+    vm->segments = NULL;
+}
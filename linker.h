@@ -0,0 +1,31 @@
+#ifndef clox_linker_h
+#define clox_linker_h
+
+#include "object.h"
+
+// a pair of read-only mappings holding the code and the constants/line info of linked functions.
+// constants fill the data mapping from the start and line numbers from the end, so later links can use the room in between.
+// a snapshot image loaded by loadSnapshot() is kept as a segment too, with all of it in code and no data
+typedef struct CodeSegment
+{
+    struct CodeSegment *next;
+    uint8_t *code;
+    size_t codeSize;
+    size_t codeUsed;
+    uint8_t *data;
+    size_t dataSize;
+    size_t constantsEnd; // constants take up data[0, constantsEnd)
+    size_t linesStart;   // line numbers take up data[linesStart, dataSize)
+    int functionCount;   // live functions whose chunks point into the segment
+} CodeSegment;
+
+// moves the chunks of the script and every function nested in it into a code segment
+void linkProgram(VM *vm, FunctionObject *script);
+
+// called when a linked function is freed. The segment is unmapped once none of its functions are left
+void releaseCodeSegment(VM *vm, CodeSegment *segment);
+
+// unmaps all code segments. The functions pointing into them must not be used afterwards.
+void freeCodeSegments(VM *vm);
+
+#endif
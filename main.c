@@ -1,13 +1,24 @@
+#include <fcntl.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "bench.h"
 #include "chunk.h"
 #include "debug.h"
+#include "prefork.h"
+#include "records.h"
+#include "scheduler.h"
+#include "snapshot.h"
 #include "vm.h"
 
-static void startRepl()
+extern char **environ;
+
+static void startRepl(VM *vm)
 {
     char line[1024];
     for (;;)
@@ -20,7 +31,7 @@ static void startRepl()
             break;
         }
 
-        interpretCode(line);
+        interpretCode(vm, line);
     }
 }
 
@@ -57,11 +68,18 @@ static char *readFile(const char *path)
     return buffer;
 }
 
-static void runFile(const char *path)
+// runs the files as one program. They are compiled in parallel
+static void runFiles(VM *vm, const char **paths, int count)
 {
-    char *sourceCode = readFile(path);
-    InterpretResult result = interpretCode(sourceCode);
-    free(sourceCode);
+    const char **sources = (const char **)malloc(count * sizeof(const char *));
+    for (int i = 0; i < count; i++)
+        sources[i] = readFile(paths[i]);
+
+    InterpretResult result = interpretSources(vm, sources, count);
+
+    for (int i = 0; i < count; i++)
+        free((char *)sources[i]);
+    free(sources);
 
     if (result == INTERPRET_COMPILE_ERROR)
         exit(65);
@@ -69,22 +87,333 @@ static void runFile(const char *path)
         exit(70);
 }
 
+static int compareNanos(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+static void reportBench(const char *label, int jobCount, int workerCount, uint64_t elapsed, uint64_t *latencies)
+{
+    qsort(latencies, jobCount, sizeof(uint64_t), compareNanos);
+    double seconds = elapsed / 1e9;
+    fprintf(stderr, "%-10s %d jobs on %d workers in %.3f s, %.0f jobs/s, latency p50 %.3f ms, p99 %.3f ms\n",
+            label, jobCount, workerCount, seconds, jobCount / seconds,
+            latencies[jobCount / 2] / 1e6, latencies[(jobCount * 99) / 100] / 1e6);
+}
+
+// runs the script jobCount times as isolates on the scheduler
+static void benchIsolates(const char *source, int jobCount, int workerCount, int outputFd)
+{
+    Job *jobs = (Job *)calloc(jobCount, sizeof(Job));
+    uint64_t *latencies = (uint64_t *)malloc(jobCount * sizeof(uint64_t));
+
+    Scheduler scheduler;
+    initScheduler(&scheduler, workerCount, NULL, outputFd);
+
+    uint64_t start = monotonicNanos();
+    for (int i = 0; i < jobCount; i++)
+    {
+        jobs[i].type = JOB_SCRIPT;
+        jobs[i].source = source;
+        submitJob(&scheduler, &jobs[i]);
+    }
+    waitForJobs(&scheduler);
+    uint64_t elapsed = monotonicNanos() - start;
+    freeScheduler(&scheduler);
+
+    for (int i = 0; i < jobCount; i++)
+        latencies[i] = jobs[i].finishedAt - jobs[i].startedAt;
+    reportBench("isolates", jobCount, workerCount, elapsed, latencies);
+
+    free(jobs);
+    free(latencies);
+}
+
+// runs the script jobCount times as separate processes, at most workerCount at a time
+static void benchProcesses(const char *path, int jobCount, int workerCount, int outputFd)
+{
+    uint64_t *latencies = (uint64_t *)malloc(jobCount * sizeof(uint64_t));
+    pid_t *running = (pid_t *)malloc(workerCount * sizeof(pid_t));
+    uint64_t *startedAt = (uint64_t *)malloc(workerCount * sizeof(uint64_t));
+    for (int i = 0; i < workerCount; i++)
+        running[i] = 0;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, outputFd, STDOUT_FILENO);
+    char *const arguments[] = {"clox", (char *)path, NULL};
+
+    uint64_t start = monotonicNanos();
+    int launched = 0;
+    int finished = 0;
+    while (finished < jobCount)
+    {
+        int slot = -1;
+        for (int i = 0; i < workerCount && slot < 0; i++)
+        {
+            if (running[i] == 0)
+                slot = i;
+        }
+
+        if (slot >= 0 && launched < jobCount)
+        {
+            startedAt[slot] = monotonicNanos();
+            if (posix_spawn(&running[slot], "/proc/self/exe", &actions, NULL, arguments, environ) != 0)
+            {
+                fprintf(stderr, "Failed to start a process.\n");
+                exit(71);
+            }
+            launched++;
+            continue;
+        }
+
+        pid_t pid = wait(NULL);
+        for (int i = 0; i < workerCount; i++)
+        {
+            if (running[i] == pid)
+            {
+                latencies[finished++] = monotonicNanos() - startedAt[i];
+                running[i] = 0;
+            }
+        }
+    }
+    uint64_t elapsed = monotonicNanos() - start;
+    reportBench("processes", jobCount, workerCount, elapsed, latencies);
+
+    posix_spawn_file_actions_destroy(&actions);
+    free(latencies);
+    free(running);
+    free(startedAt);
+}
+
+/*
+clox --jobs <count> [--workers <count>] <script>
+runs the script many times over, first as isolates on the scheduler and then with one process per run,
+and reports throughput and latency of both to stderr. The scripts' own output is discarded.
+*/
+static void runBench(int argc, const char *argv[])
+{
+    int jobCount = 0;
+    int workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+            jobCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            workerCount = atoi(argv[++i]);
+        else
+            path = argv[i];
+    }
+
+    if (path == NULL || jobCount < 1 || workerCount < 1)
+    {
+        fprintf(stderr, "Usage: clox --jobs <count> [--workers <count>] <script>\n");
+        exit(64);
+    }
+
+    int outputFd = open("/dev/null", O_WRONLY);
+    if (outputFd < 0)
+        exit(74);
+
+    char *source = readFile(path);
+    benchIsolates(source, jobCount, workerCount, outputFd);
+    benchProcesses(path, jobCount, workerCount, outputFd);
+    free(source);
+    close(outputFd);
+}
+
+static void reportMemory(const char *label, int pid, MemoryUsage *usage)
+{
+    fprintf(stderr, "%-6s %7d: rss %6zu kB, shared %6zu kB, private dirty %6zu kB", label, pid,
+            usage->rss, usage->sharedClean + usage->sharedDirty, usage->privateDirty);
+}
+
+/*
+clox --prefork <workers> <requests> <scripts...>
+runs the scripts once, then forks workers that share the resulting heap and spreads the requests over them.
+every request is a call to the scripts' global function handle(n), in a region of its own: what a request allocates
+is freed when it is done. Reports each worker's memory to stderr.
+*/
+static void runPreforkServer(VM *vm, int argc, const char *argv[])
+{
+    int workerCount = argc > 2 ? atoi(argv[2]) : 0;
+    int requestCount = argc > 3 ? atoi(argv[3]) : 0;
+    if (argc < 5 || workerCount < 1 || requestCount < 0)
+    {
+        fprintf(stderr, "Usage: clox --prefork <workers> <requests> <scripts...>\n");
+        exit(64);
+    }
+
+    runFiles(vm, argv + 4, argc - 4);
+
+    PreforkWorker *workers = (PreforkWorker *)malloc(workerCount * sizeof(PreforkWorker));
+    bool succeeded = runPrefork(vm, "handle", workerCount, requestCount, workers);
+
+    MemoryUsage usage;
+    if (readMemoryUsage(&usage))
+    {
+        reportMemory("parent", (int)getpid(), &usage);
+        fprintf(stderr, "\n");
+    }
+    for (int i = 0; i < workerCount; i++)
+    {
+        reportMemory("worker", (int)workers[i].pid, &workers[i].usage);
+        fprintf(stderr, ", %d requests, %d failed\n", workers[i].requestCount, workers[i].failedCount);
+    }
+
+    free(workers);
+    if (!succeeded)
+        exit(70);
+}
+
+/*
+clox --records [--handler <name>] [--delimiter <char>] [--regions] [--stats] <script> [inputs...]
+runs the script once, then calls its handler, handle(record) by default, with every line of the inputs, or of stdin
+if there are none. --delimiter splits records at another character. --regions frees what each batch of handler calls
+allocated once the batch is done, globals the handler set to one of those objects read nil afterwards.
+If the script defines finish(), it is called once all records are handled. --stats reports the throughput to stderr.
+*/
+static void runRecordsMode(VM *vm, int argc, const char *argv[])
+{
+    const char *handlerName = "handle";
+    char delimiter = '\n';
+    bool isReporting = false;
+    bool useRegions = false;
+    int first = 2;
+    for (; first < argc; first++)
+    {
+        if (strcmp(argv[first], "--handler") == 0 && first + 1 < argc)
+            handlerName = argv[++first];
+        else if (strcmp(argv[first], "--delimiter") == 0 && first + 1 < argc && strlen(argv[first + 1]) == 1)
+            delimiter = argv[++first][0];
+        else if (strcmp(argv[first], "--regions") == 0)
+            useRegions = true;
+        else if (strcmp(argv[first], "--stats") == 0)
+            isReporting = true;
+        else
+            break;
+    }
+
+    if (first >= argc)
+    {
+        fprintf(stderr,
+                "Usage: clox --records [--handler <name>] [--delimiter <char>] [--regions] [--stats] <script> [inputs...]\n");
+        exit(64);
+    }
+
+    runFiles(vm, argv + first, 1);
+
+    FunctionHandle handler;
+    if (!findFunction(vm, handlerName, &handler))
+    {
+        fprintf(stderr, "Undefined function '%s'.\n", handlerName);
+        exit(70);
+    }
+
+    RecordStats total = {0, 0};
+    uint64_t start = monotonicNanos();
+    bool succeeded = true;
+    int inputCount = argc - first - 1;
+    for (int i = 0; i < (inputCount > 0 ? inputCount : 1) && succeeded; i++)
+    {
+        const char *path = inputCount > 0 ? argv[first + 1 + i] : NULL;
+        int fd = path != NULL ? open(path, O_RDONLY) : STDIN_FILENO;
+        if (fd < 0)
+        {
+            fprintf(stderr, "Failed to open file \"%s\".\n", path);
+            exit(74);
+        }
+
+        RecordStats stats;
+        succeeded = runRecords(vm, &handler, fd, delimiter, useRegions, &stats);
+        total.recordCount += stats.recordCount;
+        total.byteCount += stats.byteCount;
+        if (path != NULL)
+            close(fd);
+    }
+    releaseFunction(vm, &handler);
+
+    FunctionHandle finish;
+    if (succeeded && findFunction(vm, "finish", &finish))
+    {
+        Value result;
+        succeeded = callHandle(vm, &finish, 0, NULL, &result) == INTERPRET_OK;
+        releaseFunction(vm, &finish);
+    }
+
+    if (isReporting)
+    {
+        double seconds = (monotonicNanos() - start) / 1e9;
+        fprintf(stderr, "%zu records, %.1f MB in %.3f s, %.0f MB/s\n", total.recordCount, total.byteCount / 1e6,
+                seconds, total.byteCount / 1e6 / seconds);
+    }
+    if (!succeeded)
+        exit(70);
+}
+
 int main(int argc, const char *argv[])
 {
-    initVM();
+    if (argc > 1 && strcmp(argv[1], "--jobs") == 0)
+    {
+        runBench(argc, argv);
+        return 0;
+    }
 
-    if (argc == 1)
+    // clox --bench <name> runs one of the microbenchmarks in bench.c
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
     {
-        startRepl();
+        if (argc != 3 || !runMicroBench(argv[2]))
+        {
+            fprintf(stderr, "Usage: clox --bench <name>, with one of: ");
+            listMicroBenches();
+            exit(64);
+        }
+        return 0;
     }
-    else if (argc == 2)
+
+    // never freed: exiting hands everything back at once. Static so that the heap stays reachable until then
+    static VM vm;
+    initVM(&vm);
+
+    /*
+    clox --save-snapshot <image> <scripts...> runs the scripts, then writes the VM as they left it to the image.
+    clox --snapshot <image> [scripts...] starts with the image loaded instead of running the scripts that made it.
+    */
+    if (argc > 2 && strcmp(argv[1], "--save-snapshot") == 0)
+    {
+        runFiles(&vm, argv + 3, argc - 3);
+        if (!saveSnapshot(&vm, argv[2]))
+            exit(74);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--prefork") == 0)
     {
-        runFile(argv[1]);
+        runPreforkServer(&vm, argc, argv);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--records") == 0)
+    {
+        runRecordsMode(&vm, argc, argv);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--snapshot") == 0)
+    {
+        if (!loadSnapshot(&vm, argv[2]))
+            exit(74);
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc == 1)
+    {
+        startRepl(&vm);
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFiles(&vm, argv + 1, argc - 1);
     }
 
     return 0;
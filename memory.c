@@ -1,62 +1,631 @@
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "memory.h"
 #include "vm.h"
 
-static void freeObject(Object *object)
+#define POOL_SLAB_SIZE (16 * 1024)
+
+#define IS_POOLED(size) ((size) > 0 && (size) <= POOL_MAX_SIZE)
+#define SIZE_CLASS(size) (((size)-1) / POOL_GRANULARITY)
+#define CLASS_SIZE(sizeClass) (((sizeClass) + 1) * POOL_GRANULARITY)
+
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP (1024 * 1024)
+
+// a free block stores the pointer to the next free block of the same class in its first bytes
+struct PoolBlock
+{
+  struct PoolBlock *next;
+};
+
+// slabs are linked together so that they can be released at shutdown.
+// the header is padded to POOL_GRANULARITY so that blocks stay 16-byte aligned.
+union PoolSlab
+{
+  union PoolSlab *next;
+  uint8_t padding[POOL_GRANULARITY];
+};
+
+// allocates a new slab and threads all of its blocks onto the free list of the given class
+static void refillPool(PoolCache *cache, int sizeClass)
+{
+  PoolSlab *slab = (PoolSlab *)malloc(POOL_SLAB_SIZE);
+  if (slab == NULL)
+    exit(1);
+
+  slab->next = cache->slabs;
+  cache->slabs = slab;
+
+  size_t blockSize = CLASS_SIZE(sizeClass);
+  uint8_t *block = (uint8_t *)(slab + 1);
+  uint8_t *end = (uint8_t *)slab + POOL_SLAB_SIZE;
+  for (; block + blockSize <= end; block += blockSize)
+  {
+    PoolBlock *entry = (PoolBlock *)block;
+    entry->next = cache->freeLists[sizeClass];
+    cache->freeLists[sizeClass] = entry;
+  }
+}
+
+static void *poolAllocate(PoolCache *cache, size_t size)
+{
+  int sizeClass = SIZE_CLASS(size);
+  if (cache->freeLists[sizeClass] == NULL)
+    refillPool(cache, sizeClass);
+
+  PoolBlock *block = cache->freeLists[sizeClass];
+  cache->freeLists[sizeClass] = block->next;
+  return block;
+}
+
+static void poolFree(PoolCache *cache, void *pointer, size_t size)
+{
+  int sizeClass = SIZE_CLASS(size);
+  PoolBlock *block = (PoolBlock *)pointer;
+  block->next = cache->freeLists[sizeClass];
+  cache->freeLists[sizeClass] = block;
+}
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+struct ArenaBlock
+{
+  struct ArenaBlock *next;
+  size_t capacity;
+  size_t used;
+  uint8_t padding[8]; // keeps data 16-byte aligned
+  uint8_t data[];
+};
+
+static void freeObject(VM *vm, Object *object)
 {
   switch (object->type)
   {
   case OBJECT_CLOSURE:
   {
-    FREE(ClosureObject, object);
+    freeObjectMemory(vm, object, sizeof(ClosureObject));
+    break;
+  }
+  case OBJECT_COROUTINE:
+  {
+    CoroutineObject *coroutine = (CoroutineObject *)object;
+    FREE_ARRAY(vm, CallFrame, coroutine->frames, coroutine->frameCapacity);
+    FREE_ARRAY(vm, Value, coroutine->stack, coroutine->stackCapacity);
+    freeObjectMemory(vm, object, sizeof(CoroutineObject));
+    break;
+  }
+  case OBJECT_FILE:
+  {
+    FileObject *file = (FileObject *)object;
+    if (file->chars != NULL)
+      munmap((void *)file->chars, file->length);
+    freeObjectMemory(vm, object, sizeof(FileObject));
     break;
   }
   case OBJECT_FUNCTION:
   {
     FunctionObject *function = (FunctionObject *)object;
-    freeChunk(&function->chunk);
-    FREE(FunctionObject, object);
+    freeChunk(vm, &function->chunk);
+    FREE_ARRAY(vm, char, function->source, function->sourceLength + 1);
+    freeObjectMemory(vm, object, sizeof(FunctionObject));
     break;
   }
   case OBJECT_NATIVE:
   {
-    FREE(NativeObject, object);
+    freeObjectMemory(vm, object, sizeof(NativeObject));
+    break;
+  }
+  case OBJECT_ROPE:
+  {
+    freeObjectMemory(vm, object, sizeof(RopeObject));
+    break;
+  }
+  case OBJECT_SLICE:
+  {
+    freeObjectMemory(vm, object, sizeof(SliceObject));
     break;
   }
   case OBJECT_STRING:
   {
     StringObject *string = (StringObject *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(StringObject, object);
+    freeObjectMemory(vm, object, STRING_SIZE(string->length));
     break;
   }
   }
 }
 
-void freeObjects()
+#define MARK_SLOT(object, capacity) ((uint32_t)(((uintptr_t)(object) >> 4) * 2654435761u) & ((capacity)-1))
+
+static bool findMark(MarkSet *marks, Object *object, int *slot)
+{
+  int index = MARK_SLOT(object, marks->capacity);
+  while (marks->objects[index] != NULL)
+  {
+    if (marks->objects[index] == object)
+      return true;
+    index = (index + 1) & (marks->capacity - 1);
+  }
+  *slot = index;
+  return false;
+}
+
+static void growMarks(MarkSet *marks)
+{
+  int oldCapacity = marks->capacity;
+  Object **oldObjects = marks->objects;
+
+  marks->capacity = oldCapacity < 256 ? 256 : oldCapacity * 2;
+  marks->objects = (Object **)calloc(marks->capacity, sizeof(Object *));
+  if (marks->objects == NULL)
+    exit(1);
+
+  for (int i = 0; i < oldCapacity; i++)
+  {
+    int slot;
+    if (oldObjects[i] != NULL && !findMark(marks, oldObjects[i], &slot))
+      marks->objects[slot] = oldObjects[i];
+  }
+  free(oldObjects);
+}
+
+// returns false if the object was marked already
+static bool addMark(MarkSet *marks, Object *object)
+{
+  // kept at most half full
+  if ((marks->count + 1) * 2 > marks->capacity)
+    growMarks(marks);
+
+  int slot;
+  if (findMark(marks, object, &slot))
+    return false;
+  marks->objects[slot] = object;
+  marks->count++;
+  return true;
+}
+
+bool isMarked(VM *vm, Object *object)
+{
+  int slot;
+  return object->isFrozen || (vm->marks.count > 0 && findMark(&vm->marks, object, &slot));
+}
+
+void markObject(VM *vm, Object *object)
+{
+  // frozen objects only refer to other frozen objects, unless they are coroutines
+  if (object == NULL || (object->isFrozen && object->type != OBJECT_COROUTINE))
+    return;
+  if (!addMark(&vm->marks, object))
+    return;
+
+  // marked objects are traced later from the gray stack, which avoids deep recursion.
+  // the gray stack is managed with plain realloc so growing it never counts towards the next collection
+  if (vm->grayCapacity < vm->grayCount + 1)
+  {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    vm->grayStack = (Object **)realloc(vm->grayStack, sizeof(Object *) * vm->grayCapacity);
+    if (vm->grayStack == NULL)
+      exit(1);
+  }
+  vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(VM *vm, Value value)
+{
+  if (IS_OBJECT(value))
+    markObject(vm, AS_OBJECT(value));
+}
+
+static void markTable(VM *vm, Table *table)
+{
+  for (int i = 0; i < table->capacity; i++)
+  {
+    if (table->control[i] < 0)
+      continue;
+    markObject(vm, (Object *)table->entries[i].key);
+    markValue(vm, table->entries[i].value);
+  }
+}
+
+// marks everything an already marked object refers to
+static void blackenObject(VM *vm, Object *object)
+{
+  switch (object->type)
+  {
+  case OBJECT_CLOSURE:
+    markObject(vm, (Object *)((ClosureObject *)object)->function);
+    break;
+  case OBJECT_COROUTINE:
+  {
+    CoroutineObject *coroutine = (CoroutineObject *)object;
+    markObject(vm, (Object *)coroutine->function);
+    markObject(vm, (Object *)coroutine->resumer);
+
+    // the stacks of the running coroutine are the VM's current stacks and are marked as roots
+    if (coroutine->state == COROUTINE_RUNNING)
+      break;
+    for (Value *slot = coroutine->stack; slot < coroutine->stackTop; slot++)
+      markValue(vm, *slot);
+    for (int i = 0; i < coroutine->frameCount; i++)
+      markObject(vm, (Object *)coroutine->frames[i].function);
+    break;
+  }
+  case OBJECT_FUNCTION:
+  {
+    FunctionObject *function = (FunctionObject *)object;
+    markObject(vm, (Object *)function->name);
+    for (int i = 0; i < function->chunk.constants.count; i++)
+      markValue(vm, function->chunk.constants.values[i]);
+    break;
+  }
+  case OBJECT_ROPE:
+  {
+    RopeObject *rope = (RopeObject *)object;
+    markObject(vm, rope->left);
+    markObject(vm, rope->right);
+    markObject(vm, (Object *)rope->flat);
+    break;
+  }
+  case OBJECT_SLICE:
+    markObject(vm, ((SliceObject *)object)->owner);
+    break;
+  case OBJECT_NATIVE:
+    markObject(vm, (Object *)((NativeObject *)object)->name);
+    break;
+  case OBJECT_FILE:
+  case OBJECT_STRING:
+    break;
+  }
+}
+
+static void markRoots(VM *vm)
+{
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
+    markValue(vm, *slot);
+
+  for (int i = 0; i < vm->frameCount; i++)
+    markObject(vm, (Object *)vm->frames[i].function);
+
+  // while a coroutine runs, the main program's stacks are put aside
+  if (vm->coroutine != NULL)
+  {
+    for (Value *slot = vm->mainStack; slot < vm->mainStackTop; slot++)
+      markValue(vm, *slot);
+    for (int i = 0; i < vm->mainFrameCount; i++)
+      markObject(vm, (Object *)vm->mainFrames[i].function);
+    markObject(vm, (Object *)vm->coroutine);
+  }
+
+  // tasks waiting for I/O or a timer are only referenced by the event loop
+  markEventLoop(vm);
+
+  // whatever the host holds on to or is passing in and getting back right now
+  for (int i = 0; i < vm->pinned.count; i++)
+    markValue(vm, vm->pinned.values[i]);
+  for (int i = 0; i < vm->hostArgCount; i++)
+    markValue(vm, vm->hostArgs[i]);
+  for (int i = 0; i < vm->hostResultCount; i++)
+    markValue(vm, vm->hostResults[i]);
+
+  // vm->strings is deliberately not a root: it only holds on to strings that are reachable otherwise
+  markTable(vm, &vm->globals);
+}
+
+static void sweep(VM *vm)
+{
+  Object *previous = NULL;
+  Object *object = vm->objects;
+  while (object != vm->frozenObjects)
+  {
+    if (isMarked(vm, object))
+    {
+      previous = object;
+      object = object->next;
+      continue;
+    }
+
+    Object *unreached = object;
+    object = object->next;
+    if (previous != NULL)
+      previous->next = object;
+    else
+      vm->objects = object;
+    freeObject(vm, unreached);
+  }
+}
+
+void collectGarbage(VM *vm)
+{
+  // region objects aren't collected one by one, and sweeping could free the region's mark
+  if (vm->region.isActive)
+    return;
+
+  markRoots(vm);
+  while (vm->grayCount > 0)
+    blackenObject(vm, vm->grayStack[--vm->grayCount]);
+
+  // drop interned strings that nothing refers to anymore, before sweep frees them
+  tableRemoveUnmarked(vm, &vm->strings);
+  sweep(vm);
+
+  if (vm->marks.count > 0)
+    memset(vm->marks.objects, 0, sizeof(Object *) * vm->marks.capacity);
+  vm->marks.count = 0;
+
+  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+  if (vm->nextGC < GC_MIN_HEAP)
+    vm->nextGC = GC_MIN_HEAP;
+}
+
+void freeObjects(VM *vm)
 {
-  Object *object = vm.objects;
+  Object *object = vm->objects;
   while (object != NULL)
   {
     Object *next = object->next;
-    freeObject(object);
+    freeObject(vm, object);
     object = next;
   }
+
+  free(vm->grayStack);
+  vm->grayStack = NULL;
+  vm->grayCapacity = 0;
+  vm->grayCount = 0;
+
+  free(vm->marks.objects);
+  vm->marks.objects = NULL;
+  vm->marks.capacity = 0;
+  vm->marks.count = 0;
+  vm->frozenObjects = NULL;
+}
+
+Object *allocateObjectMemory(VM *vm, size_t size)
+{
+  Object *object;
+  if (vm->region.isActive)
+    object = (Object *)arenaReallocate(&vm->region.arena, NULL, 0, size);
+  else
+    object = (Object *)reallocate(vm, NULL, 0, size);
+  object->isRegion = vm->region.isActive;
+  object->isMapped = false;
+  object->isFrozen = false;
+  return object;
+}
+
+// region objects go back with the whole arena, mapped ones with the snapshot image
+void freeObjectMemory(VM *vm, Object *object, size_t size)
+{
+  if (!object->isRegion && !object->isMapped)
+    reallocate(vm, object, size, 0);
+}
+
+void freezeObjects(VM *vm)
+{
+  for (Object *object = vm->objects; object != vm->frozenObjects; object = object->next)
+    object->isFrozen = true;
+  vm->frozenObjects = vm->objects;
+
+  // the free blocks are left alone, reusing them would write to pages full of frozen objects
+  memset(vm->pools.freeLists, 0, sizeof(vm->pools.freeLists));
+}
+
+void beginRegion(VM *vm)
+{
+  vm->region.isActive = true;
+  vm->region.mark = vm->objects;
+}
+
+// a global keyed by a region string is dropped, one holding a region object is cleared
+static void removeRegionGlobals(VM *vm)
+{
+  Table *globals = &vm->globals;
+  for (int i = 0; i < globals->capacity; i++)
+  {
+    Value value = globals->entries[i].value;
+    if (globals->control[i] >= 0 && IS_OBJECT(value) && AS_OBJECT(value)->isRegion)
+      globals->entries[i].value = NIL_VAL;
+  }
+  tableRemoveRegionKeys(vm, globals);
+}
+
+void endRegion(VM *vm)
+{
+  if (!vm->region.isActive)
+    return;
+
+  removeRegionGlobals(vm);
+  // a pinned region object reads as nil from now on, but its slot stays taken until the host unpins it
+  for (int i = 0; i < vm->pinned.count; i++)
+  {
+    Value value = vm->pinned.values[i];
+    if (IS_OBJECT(value) && AS_OBJECT(value)->isRegion)
+      vm->pinned.values[i] = NIL_VAL;
+  }
+
+  // everything in front of the mark was allocated during the region. Only what the objects own is freed one by one.
+  // objects allocated while the region was paused, like the constants of a function compiled on its first call, are kept
+  Object *kept = vm->region.mark;
+  Object *object = vm->objects;
+  while (object != vm->region.mark)
+  {
+    Object *next = object->next;
+    if (!object->isRegion)
+    {
+      object->next = kept;
+      kept = object;
+    }
+    else
+    {
+      if (object->type == OBJECT_STRING && ((StringObject *)object)->isInterned)
+        tableDelete(vm, &vm->strings, (StringObject *)object);
+      freeObject(vm, object);
+    }
+    object = next;
+  }
+  vm->objects = kept;
+
+  resetArena(&vm->region.arena);
+  vm->region.isActive = false;
+  vm->region.mark = NULL;
 }
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+void freeMemoryPools(VM *vm)
 {
+  PoolSlab *slab = vm->pools.slabs;
+  while (slab != NULL)
+  {
+    PoolSlab *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  memset(&vm->pools, 0, sizeof(vm->pools));
+}
+
+/*
+oldSize tells us where the block came from: small blocks live in the pools,
+everything else was handed out by the system allocator.
+*/
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize)
+{
+  vm->bytesAllocated += newSize - oldSize;
+
+  bool oldPooled = pointer != NULL && IS_POOLED(oldSize);
+
   // if newSize is 0, free the memory block
   if (newSize == 0)
   {
-    free(pointer);
+    if (oldPooled)
+      poolFree(&vm->pools, pointer, oldSize);
+    else
+      free(pointer);
     return NULL;
   }
 
+  if (IS_POOLED(newSize))
+  {
+    // the block is already big enough, no need to move it
+    if (oldPooled && SIZE_CLASS(oldSize) == SIZE_CLASS(newSize))
+      return pointer;
+
+    void *result = poolAllocate(&vm->pools, newSize);
+    if (pointer != NULL)
+    {
+      memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+      reallocate(vm, pointer, oldSize, 0);
+    }
+    return result;
+  }
+
+  // large blocks go to the system allocator
+  if (oldPooled)
+  {
+    void *result = malloc(newSize);
+    if (result == NULL)
+      exit(1);
+    memcpy(result, pointer, oldSize);
+    poolFree(&vm->pools, pointer, oldSize);
+    return result;
+  }
+
   // else use the std library function to resize the memory block
   void *result = realloc(pointer, newSize);
   if (result == NULL)
     exit(1);
   return result;
 }
+
+void lockHeap(VM *vm)
+{
+  pthread_mutex_lock(&vm->heapLock);
+}
+
+void unlockHeap(VM *vm)
+{
+  pthread_mutex_unlock(&vm->heapLock);
+}
+
+void initArena(Arena *arena)
+{
+  arena->blocks = NULL;
+}
+
+static void *arenaAllocate(Arena *arena, size_t size)
+{
+  size = ARENA_ALIGN(size);
+
+  ArenaBlock *block = arena->blocks;
+  if (block == NULL || block->capacity - block->used < size)
+  {
+    // oversized requests get a block of their own
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + capacity);
+    if (block == NULL)
+      exit(1);
+    block->capacity = capacity;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  void *result = block->data + block->used;
+  block->used += size;
+  return result;
+}
+
+/*
+nothing is ever freed individually: shrinking is a no-op and growing copies into fresh space,
+unless the block is the most recent allocation and can simply be extended in place.
+*/
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize, size_t newSize)
+{
+  if (newSize <= oldSize)
+    return newSize == 0 ? NULL : pointer;
+
+  ArenaBlock *block = arena->blocks;
+  if (pointer != NULL && block != NULL &&
+      (uint8_t *)pointer + ARENA_ALIGN(oldSize) == block->data + block->used &&
+      block->used - ARENA_ALIGN(oldSize) + ARENA_ALIGN(newSize) <= block->capacity)
+  {
+    block->used += ARENA_ALIGN(newSize) - ARENA_ALIGN(oldSize);
+    return pointer;
+  }
+
+  void *result = arenaAllocate(arena, newSize);
+  if (pointer != NULL)
+    memcpy(result, pointer, oldSize);
+  return result;
+}
+
+void freeArena(Arena *arena)
+{
+  ArenaBlock *block = arena->blocks;
+  while (block != NULL)
+  {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  initArena(arena);
+}
+
+void resetArena(Arena *arena)
+{
+  ArenaBlock *block = arena->blocks;
+  if (block == NULL)
+    return;
+
+  // the newest block is kept unless it was made for one oversized request
+  arena->blocks = block->next;
+  freeArena(arena);
+  if (block->capacity == ARENA_BLOCK_SIZE)
+  {
+    block->used = 0;
+    block->next = NULL;
+    arena->blocks = block;
+  }
+  else
+    free(block);
+}
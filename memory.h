@@ -4,22 +4,133 @@
 #include "common.h"
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-  (type *)reallocate(NULL, 0, sizeof(type) * (count))
+// every allocation is charged to a VM, which owns the heap it comes from
+#define ALLOCATE(vm, type, count) \
+  (type *)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-  reallocate(pointer, sizeof(type) * oldCount, 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+  reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-  ((type *)reallocate(pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount)))
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+  ((type *)reallocate(vm, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount)))
+
+// grows an array that lives in an arena. The old contents are copied, the old space is reclaimed with the arena.
+#define ARENA_GROW_ARRAY(arena, type, pointer, oldCount, newCount) \
+  ((type *)arenaReallocate(arena, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount)))
+
+// small blocks are carved out of larger slabs and kept on one free list per size class.
+// sizes are rounded up to a multiple of POOL_GRANULARITY, so every class is POOL_GRANULARITY apart.
+#define POOL_GRANULARITY 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULARITY)
+
+typedef struct PoolBlock PoolBlock;
+typedef union PoolSlab PoolSlab;
+
+// the free lists of one VM. Each VM has its own, so VMs on different threads never share a pool
+typedef struct
+{
+  PoolBlock *freeLists[POOL_CLASS_COUNT];
+  PoolSlab *slabs;
+} PoolCache;
+
+typedef struct ArenaBlock ArenaBlock;
+
+// a bump allocator for short-lived data that is released all at once
+struct Arena
+{
+  ArenaBlock *blocks; // the block allocations are currently bumped from, with older blocks linked behind it
+};
+
+/*
+a region collects every object allocated between beginRegion() and endRegion(), like everything a request handler creates.
+its objects are bump allocated from the region's arena. They sit in front of the mark in the objects list,
+so endRegion() finds them without tracing anything and releases them all at once.
+the garbage collector doesn't run while a region is active.
+*/
+typedef struct
+{
+  bool isActive;
+  Object *mark; // the head of the objects list when the region began
+  Arena arena;
+} Region;
+
+/*
+the objects the collection in progress has reached. Marks are kept here instead of in the objects,
+so collecting garbage never writes to an object, and a forked worker's pages stay shared with its parent.
+open addressing on the object's address, with plain malloc so it never counts towards the next collection.
+*/
+typedef struct
+{
+  Object **objects; // NULL for a free slot
+  int count;
+  int capacity; // 0 or a power of two
+} MarkSet;
 
 // Walks the linked list of objects and frees all nodes.
-void freeObjects();
+void freeObjects(VM *vm);
+
+void markObject(VM *vm, Object *object);
+
+// true if the collection in progress reached the object. Frozen objects always count as reached
+bool isMarked(VM *vm, Object *object);
+void markValue(VM *vm, Value value);
+
+/*
+frees every object that can't be reached from the stack or the globals and drops
+unreachable strings from the intern table. Only runs at points where every live
+object is rooted, which is between instructions or outside of the interpreter.
+*/
+void collectGarbage(VM *vm);
+
+// oldSize must be the size the block was allocated with, since it decides which pool the block goes back to.
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize);
+
+// memory for a new object: from the region's arena while a region is active, from the heap otherwise.
+// sets the object's isRegion flag, the caller fills in the rest of the header
+Object *allocateObjectMemory(VM *vm, size_t size);
+void freeObjectMemory(VM *vm, Object *object, size_t size);
+
+/*
+makes every object allocated so far permanent, so a process forked from here on can share them with its parent.
+frozen objects are never swept, marked or traced, which leaves their pages untouched by collections in the child.
+that is only safe because a frozen object never refers to a newer one, except a coroutine, whose stacks change
+when it runs. Frozen coroutines are still traced. Callers make sure the rest are final before freezing:
+ropes flattened and function bodies compiled.
+small allocations made afterwards come from fresh slabs, instead of from free blocks between frozen objects.
+*/
+void freezeObjects(VM *vm);
+
+/*
+objects allocated from now on belong to the region, until endRegion() frees them.
+only call this between calls into the VM. Regions don't nest.
+*/
+void beginRegion(VM *vm);
+
+/*
+frees every object allocated since beginRegion() and drops its strings from the intern table.
+globals defined during the region are removed again, and globals that were set to one of its objects become nil.
+nothing else may hold on to a region object after this, including values returned by callFunction().
+*/
+void endRegion(VM *vm);
+
+// releases the slabs backing the small-object pools. Only call once nothing allocated from them is alive.
+void freeMemoryPools(VM *vm);
+
+// reallocate() isn't thread-safe. Threads that allocate from the same VM at the same time,
+// like the compiler threads, hold the VM's heap lock around it. The interpreter doesn't need to
+void lockHeap(VM *vm);
+void unlockHeap(VM *vm);
+
+void initArena(Arena *arena);
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize, size_t newSize);
+void freeArena(Arena *arena);
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+// frees all allocations like freeArena(), but keeps one block around for the next round
+void resetArena(Arena *arena);
 
 #endif
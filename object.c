@@ -8,41 +8,76 @@
 #include "vm.h"
 
 #define ALLOCATE_OBJECT(type, objectType) \
-    (type *)allocateObject(sizeof(type), objectType)
+    (type *)allocateObject(vm, sizeof(type), objectType)
+
+// The newly allocated object is added to the beginning of the singly linked list.
+static void linkObject(VM *vm, Object *object)
+{
+    object->next = vm->objects;
+    vm->objects = object;
+}
 
 // allocates an object of given size and type on the heap
-static Object *allocateObject(size_t size, ObjectType type)
+static Object *allocateObject(VM *vm, size_t size, ObjectType type)
 {
-    Object *object = (Object *)reallocate(NULL, 0, size);
+    Object *object = allocateObjectMemory(vm, size);
     object->type = type;
-
-    // The newly allocated object is added to the beginning of the singly linked list.
-    object->next = vm.objects;
-    vm.objects = object;
-
+    linkObject(vm, object);
     return object;
 }
 
-ClosureObject *newClosure(FunctionObject *function)
+ClosureObject *newClosure(VM *vm, FunctionObject *function)
 {
     ClosureObject *closure = ALLOCATE_OBJECT(ClosureObject, OBJECT_CLOSURE);
     closure->function = function;
     return closure;
 }
 
-FunctionObject *newFunction()
+// the stacks are allocated when the coroutine is first resumed
+CoroutineObject *newCoroutine(VM *vm, FunctionObject *function)
+{
+    CoroutineObject *coroutine = ALLOCATE_OBJECT(CoroutineObject, OBJECT_COROUTINE);
+    coroutine->state = COROUTINE_SUSPENDED;
+    coroutine->function = function;
+    coroutine->resumer = NULL;
+    coroutine->isTask = false;
+    coroutine->frames = NULL;
+    coroutine->frameCount = 0;
+    coroutine->frameCapacity = 0;
+    coroutine->stack = NULL;
+    coroutine->stackTop = NULL;
+    coroutine->stackCapacity = 0;
+    return coroutine;
+}
+
+FileObject *newFile(VM *vm, const char *chars, size_t length)
+{
+    FileObject *file = ALLOCATE_OBJECT(FileObject, OBJECT_FILE);
+    file->chars = chars;
+    file->length = length;
+    file->position = 0;
+    file->released = 0;
+    return file;
+}
+
+FunctionObject *newFunction(VM *vm)
 {
     FunctionObject *function = ALLOCATE_OBJECT(FunctionObject, OBJECT_FUNCTION);
     function->arity = 0;
+    function->maxSlots = 1;
     function->name = NULL;
+    function->source = NULL;
+    function->sourceLength = 0;
+    function->sourceLine = 0;
     initChunk(&function->chunk);
     return function;
 }
 
-NativeObject *newNative(NativeFunction function)
+NativeObject *newNative(VM *vm, NativeFunction function, StringObject *name)
 {
     NativeObject *native = ALLOCATE_OBJECT(NativeObject, OBJECT_NATIVE);
     native->function = function;
+    native->name = name;
     return native;
 }
 
@@ -56,64 +91,321 @@ static void printFunction(FunctionObject *function)
     printf("<fn %s>", function->name->chars);
 }
 
-static StringObject *allocateString(char *chars, int length, uint32_t hash)
+// hashes short strings using the "FNV-1a" hash function
+static uint32_t hashShortString(const char *key, int length)
 {
-    StringObject *string = ALLOCATE_OBJECT(StringObject, OBJECT_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
 
-    // we use the strings table only for storing the keys (strings) so we just use nil for the values
-    tableAdd(&vm.strings, string, NIL_VAL);
-    return string;
+static inline uint64_t readWord(const char *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// multiplies into 128 bits and folds the halves together
+static inline uint64_t mixWords(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
 }
 
-// hashes a string using the "FNV-1a" hash function
+/*
+longer strings are hashed 16 bytes at a time in the style of wyhash.
+the last 16 bytes are always read as a whole, overlapping the previous block if needed.
+the result is never 0, since 0 marks a string whose hash hasn't been computed yet.
+*/
 static uint32_t hashString(const char *key, int length)
 {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++)
+    uint32_t hash;
+    if (length < 16)
     {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+        hash = hashShortString(key, length);
+    }
+    else
+    {
+        uint64_t seed = 0xa0761d6478bd642full ^ (uint64_t)length;
+        int i = 0;
+        for (; i + 16 < length; i += 16)
+            seed = mixWords(readWord(key + i) ^ 0xe7037ed1a0b428dbull, readWord(key + i + 8) ^ seed);
+
+        seed = mixWords(readWord(key + length - 16) ^ 0x8ebc6af09c88c6e3ull, readWord(key + length - 8) ^ seed);
+        uint64_t mixed = mixWords(seed ^ 0x589965cc75374cc3ull, (uint64_t)length ^ 0xe7037ed1a0b428dbull);
+        hash = (uint32_t)(mixed ^ (mixed >> 32));
     }
+    return hash != 0 ? hash : 1;
 }
 
-// allocates array just big enough for the string.
-// then copies the characters from the lexeme to the array
-StringObject *copyString(const char *chars, int length)
+StringObject *allocateString(VM *vm, int length)
+{
+    // the caller links the string into the objects list once its characters are in place
+    StringObject *string = (StringObject *)allocateObjectMemory(vm, STRING_SIZE(length));
+    string->object.type = OBJECT_STRING;
+    string->object.next = NULL;
+    string->length = length;
+    string->hash = 0;
+    string->isInterned = false;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// records a new string in the strings table
+static StringObject *addString(VM *vm, StringObject *string, uint32_t hash)
+{
+    string->hash = hash;
+    string->isInterned = true;
+    linkObject(vm, (Object *)string);
+
+    // we use the strings table only for storing the keys (strings) so we just use nil for the values
+    tableAdd(vm, &vm->strings, string, NIL_VAL);
+    return string;
+}
+
+// allocates a string object just big enough for the characters.
+// then copies the characters from the lexeme into it
+StringObject *copyString(VM *vm, const char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
 
     // check if there is already a textually equal string
-    StringObject *interned = tableFindString(&vm.strings, chars, length, hash);
+    StringObject *interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != NULL)
         return interned;
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    StringObject *string = allocateString(vm, length);
+    memcpy(string->chars, chars, length);
+    return addString(vm, string, hash);
 }
 
-// take ownership of a string
-StringObject *takeString(char *chars, int length)
+StringObject *newBufferString(VM *vm, int length)
 {
-    uint32_t hash = hashString(chars, length);
+    StringObject *string = allocateString(vm, length);
+    linkObject(vm, (Object *)string);
+    return string;
+}
 
-    // if we find the string in the table, just return that string
-    // and free memory for the string that was passed to this function
-    StringObject *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL)
+SliceObject *newSlice(VM *vm, Object *owner, const char *chars, int length)
+{
+    SliceObject *slice = ALLOCATE_OBJECT(SliceObject, OBJECT_SLICE);
+    slice->owner = owner;
+    slice->chars = chars;
+    slice->length = length;
+    return slice;
+}
+
+static int stringLength(Object *string)
+{
+    switch (string->type)
     {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    case OBJECT_ROPE:
+        return ((RopeObject *)string)->length;
+    case OBJECT_SLICE:
+        return ((SliceObject *)string)->length;
+    default:
+        return ((StringObject *)string)->length;
     }
+}
 
-    return allocateString(chars, length, hash);
+// a rope that has already been flattened is only a wrapper around its flat string
+static Object *unwrapRope(Object *string)
+{
+    if (string->type == OBJECT_ROPE && ((RopeObject *)string)->flat != NULL)
+        return (Object *)((RopeObject *)string)->flat;
+    return string;
 }
 
-void printObject(Value value)
+static RopeObject *newRope(VM *vm, Object *left, Object *right)
+{
+    RopeObject *rope = ALLOCATE_OBJECT(RopeObject, OBJECT_ROPE);
+    rope->length = stringLength(left) + stringLength(right);
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+const char *stringChars(VM *vm, Object *string, int *length)
+{
+    if (string->type == OBJECT_SLICE)
+    {
+        SliceObject *slice = (SliceObject *)string;
+        *length = slice->length;
+        return slice->chars;
+    }
+
+    StringObject *flat = flattenString(vm, string);
+    *length = flat->length;
+    return flat->chars;
+}
+
+/*
+copies the characters of a string, rope or slice so that they end right before end.
+the tree is walked right to left with an explicit stack. Strings built in a loop
+produce left-deep ropes, for which the stack never holds more than a couple of nodes.
+*/
+static void copyChars(VM *vm, Object *string, char *end)
+{
+    int capacity = 0;
+    int count = 0;
+    Object **stack = NULL;
+
+    Object *node = string;
+    for (;;)
+    {
+        node = unwrapRope(node);
+        if (node->type == OBJECT_ROPE)
+        {
+            RopeObject *rope = (RopeObject *)node;
+            if (capacity < count + 1)
+            {
+                int oldCapacity = capacity;
+                capacity = GROW_CAPACITY(oldCapacity);
+                stack = GROW_ARRAY(vm, Object *, stack, oldCapacity, capacity);
+            }
+            stack[count++] = rope->left;
+            node = rope->right;
+            continue;
+        }
+
+        int length;
+        const char *chars = stringChars(vm, node, &length);
+        end -= length;
+        memcpy(end, chars, length);
+
+        if (count == 0)
+            break;
+        node = stack[--count];
+    }
+
+    FREE_ARRAY(vm, Object *, stack, capacity);
+}
+
+// builds a flat string that is only referenced from inside a rope
+static StringObject *newLeaf(VM *vm, Object *left, Object *right)
+{
+    int leftLength = stringLength(left);
+    StringObject *leaf = allocateString(vm, leftLength + stringLength(right));
+    copyChars(vm, left, leaf->chars + leftLength);
+    copyChars(vm, right, leaf->chars + leaf->length);
+    linkObject(vm, (Object *)leaf);
+    return leaf;
+}
+
+static Object *appendToRope(VM *vm, Object *left, Object *right)
+{
+    left = unwrapRope(left);
+    right = unwrapRope(right);
+
+    // appending short pieces one by one would give a rope node per piece.
+    // merge them into the rope's last leaf instead, as long as that leaf stays short.
+    if (left->type == OBJECT_ROPE && right->type != OBJECT_ROPE)
+    {
+        RopeObject *rope = (RopeObject *)left;
+        Object *last = unwrapRope(rope->right);
+        if (last->type != OBJECT_ROPE &&
+            stringLength(last) + stringLength(right) < ROPE_MIN_LENGTH)
+        {
+            return (Object *)newRope(vm, rope->left, (Object *)newLeaf(vm, last, right));
+        }
+    }
+
+    return (Object *)newRope(vm, left, right);
+}
+
+Object *concatenateStrings(VM *vm, Object **strings, int count)
+{
+    int length = 0;
+    for (int i = 0; i < count; i++)
+        length += stringLength(strings[i]);
+
+    // short results are cheaper to copy right away.
+    // they are neither hashed nor interned, many of them are only ever printed
+    if (length < ROPE_MIN_LENGTH)
+    {
+        StringObject *result = allocateString(vm, length);
+        char *end = result->chars;
+        for (int i = 0; i < count; i++)
+        {
+            end += stringLength(strings[i]);
+            copyChars(vm, strings[i], end);
+        }
+        linkObject(vm, (Object *)result);
+        return (Object *)result;
+    }
+
+    Object *result = strings[0];
+    for (int i = 1; i < count; i++)
+        result = appendToRope(vm, result, strings[i]);
+    return result;
+}
+
+StringObject *flattenString(VM *vm, Object *string)
+{
+    if (string->type == OBJECT_STRING)
+        return (StringObject *)string;
+
+    // slices are copied out of their owner, ropes are put together and keep the result
+    if (string->type == OBJECT_SLICE)
+    {
+        SliceObject *slice = (SliceObject *)string;
+        StringObject *flat = allocateString(vm, slice->length);
+        memcpy(flat->chars, slice->chars, slice->length);
+        linkObject(vm, (Object *)flat);
+        return flat;
+    }
+
+    RopeObject *rope = (RopeObject *)string;
+    if (rope->flat == NULL)
+    {
+        StringObject *flat = allocateString(vm, rope->length);
+        copyChars(vm, string, flat->chars + flat->length);
+        linkObject(vm, (Object *)flat);
+
+        // a rope from before the region can't keep a string that is freed when the region ends,
+        // and a frozen rope isn't traced, so it can't keep anything newer than itself
+        if ((flat->object.isRegion && !rope->object.isRegion) || rope->object.isFrozen)
+            return flat;
+
+        rope->flat = flat;
+
+        // the children are not needed anymore
+        rope->left = NULL;
+        rope->right = NULL;
+    }
+    return rope->flat;
+}
+
+bool stringsEqual(VM *vm, Object *a, Object *b)
+{
+    if (a == b)
+        return true;
+    if (stringLength(a) != stringLength(b))
+        return false;
+
+    // two distinct interned strings can never be equal
+    if (a->type == OBJECT_STRING && b->type == OBJECT_STRING)
+    {
+        StringObject *stringA = (StringObject *)a;
+        StringObject *stringB = (StringObject *)b;
+        if (stringA->isInterned && stringB->isInterned)
+            return false;
+    }
+
+    // slices are compared in place, ropes get flattened
+    int length;
+    const char *charsA = stringChars(vm, a, &length);
+    const char *charsB = stringChars(vm, b, &length);
+    return memcmp(charsA, charsB, length) == 0;
+}
+
+void printObject(VM *vm, Value value)
 {
     switch (OBJ_TYPE(value))
     {
@@ -122,9 +414,21 @@ void printObject(Value value)
     case OBJECT_FUNCTION:
         printFunction(AS_FUNCTION(value));
         break;
+    case OBJECT_COROUTINE:
+        printf("<coroutine>");
+        break;
+    case OBJECT_FILE:
+        printf("<file>");
+        break;
     case OBJECT_NATIVE:
         printf("<native fn>");
         break;
+    case OBJECT_ROPE:
+        printf("%s", flattenString(vm, AS_OBJECT(value))->chars);
+        break;
+    case OBJECT_SLICE:
+        printf("%.*s", AS_SLICE(value)->length, AS_SLICE(value)->chars);
+        break;
     case OBJECT_STRING:
         printf("%s", AS_CSTRING(value));
         break;
@@ -9,8 +9,12 @@
 typedef enum
 {
     OBJECT_CLOSURE,
+    OBJECT_COROUTINE,
+    OBJECT_FILE,
     OBJECT_FUNCTION,
     OBJECT_NATIVE,
+    OBJECT_ROPE,
+    OBJECT_SLICE,
     OBJECT_STRING
 } ObjectType;
 
@@ -18,6 +22,9 @@ typedef enum
 struct Object
 {
     ObjectType type;
+    bool isRegion;       // allocated inside a region, see beginRegion()
+    bool isMapped;       // lives in a snapshot image mapped by loadSnapshot() and is never freed on its own
+    bool isFrozen;       // allocated before freezeObjects() and never freed by a collection
     struct Object *next; // points to the next object in the linked list
 };
 
@@ -26,17 +33,55 @@ typedef struct
 {
     Object object;
     int arity;
+    int maxSlots; // the most stack slots a call can use, counting the callee and the arguments
     Chunk chunk;
     StringObject *name;
+    char *source;     // parameters and body of a function that hasn't been compiled yet, NULL once it is
+    int sourceLength;
+    int sourceLine;   // line the source starts on
 } FunctionObject;
 
+typedef struct
+{
+    FunctionObject *function;
+    uint8_t *instructionPointer;
+    Value *slots; // The first slot on the VM's value stack that the function can use
+} CallFrame;
+
+typedef enum
+{
+    COROUTINE_SUSPENDED, // created but not started yet, or stopped at a yield
+    COROUTINE_RUNNING,
+    COROUTINE_NORMAL, // resumed another coroutine and waits for it to yield
+    COROUTINE_DONE
+} CoroutineState;
+
+// a function running on its own value and call frame stacks, so it can stop at any depth and continue later.
+// while it runs, the VM works directly on these stacks. They are only saved back here when it stops
+typedef struct CoroutineObject
+{
+    Object object;
+    CoroutineState state;
+    FunctionObject *function;
+    struct CoroutineObject *resumer; // whoever resumed it last. NULL for the main program
+    bool isTask;                     // started with spawn() and resumed by the event loop only
+
+    CallFrame *frames;
+    int frameCount;
+    int frameCapacity;
+    Value *stack;
+    Value *stackTop;
+    int stackCapacity;
+} CoroutineObject;
+
 // NativeFunction is a pointer to a function that returns Value
-typedef Value (*NativeFunction)(int argCount, Value *args);
+typedef Value (*NativeFunction)(VM *vm, int argCount, Value *args);
 
 typedef struct
 {
     Object object;
     NativeFunction function;
+    StringObject *name; // the global defineNative() bound it to
 } NativeObject;
 
 // string objects
@@ -44,25 +89,95 @@ struct StringObject
 {
     Object object;
     int length;
-    char *chars;
-    uint32_t hash; // since strings are immutable, we can calculate and store hash up front
+    uint32_t hash;    // set when the string is interned, 0 for strings that never are
+    bool isInterned;  // true for strings that are in the VM's strings table. Only those are used as table keys
+    char chars[];     // the characters are stored inline, right after the header
 };
 
+// size of a string object holding length characters plus the terminating '\0'
+#define STRING_SIZE(length) (sizeof(StringObject) + (length) + 1)
+
+// results shorter than this are copied into a flat string right away instead of becoming a rope
+#define ROPE_MIN_LENGTH 64
+
+// a lazy concatenation of two strings. The characters are only put together
+// when the rope is compared or printed, which keeps building strings in a loop linear.
+typedef struct
+{
+    Object object;
+    int length;
+    Object *left; // both sides are strings or ropes
+    Object *right;
+    StringObject *flat; // once flattened, the resulting flat string. left and right are dropped then
+} RopeObject;
+
+// substrings shorter than this are copied, longer ones share the characters of their parent
+#define SLICE_MIN_LENGTH 32
+
+// a view into the characters of another object, so substrings don't need to be copied.
+// it is only copied into a flat string when something needs one.
+typedef struct
+{
+    Object object;
+    Object *owner; // keeps the characters alive. A string that isn't a slice itself, or a file
+    const char *chars;
+    int length;
+} SliceObject;
+
 typedef struct
 {
     Object object;
     FunctionObject *function;
 } ClosureObject;
 
-ClosureObject *newClosure(FunctionObject *function);
+// a file mapped read-only into memory. Its contents are handed out as slices, so the mapping stays
+// until the file object and every slice of it are collected
+typedef struct
+{
+    Object object;
+    const char *chars; // NULL for an empty file
+    size_t length;
+    size_t position;   // where the next readLine() starts
+    size_t released;   // the pages before this have been handed back to the kernel
+} FileObject;
+
+ClosureObject *newClosure(VM *vm, FunctionObject *function);
+
+CoroutineObject *newCoroutine(VM *vm, FunctionObject *function);
+
+// takes over a mapping made with mmap(). It is unmapped when the object is freed
+FileObject *newFile(VM *vm, const char *chars, size_t length);
 
-FunctionObject *newFunction();
+FunctionObject *newFunction(VM *vm);
 
-NativeObject *newNative(NativeFunction function);
+NativeObject *newNative(VM *vm, NativeFunction function, StringObject *name);
 
-StringObject *copyString(const char *chars, int length);
-StringObject *takeString(char *chars, int length);
-void printObject(Value value);
+StringObject *copyString(VM *vm, const char *chars, int length);
+
+// allocates a string with room for length characters. The caller fills in the characters
+// and links the string into the objects list. Such strings are never interned, copyString() makes those
+StringObject *allocateString(VM *vm, int length);
+
+// a string with room for length characters that is never interned, like a block of input that records are
+// sliced out of. The caller fills in the characters
+StringObject *newBufferString(VM *vm, int length);
+
+SliceObject *newSlice(VM *vm, Object *owner, const char *chars, int length);
+
+// returns the characters of a string, rope or slice without copying them. Ropes are flattened.
+// the characters of a slice are not terminated by '\0'
+const char *stringChars(VM *vm, Object *string, int *length);
+
+// concatenates count strings, ropes or slices, left to right. Long results are returned as ropes.
+Object *concatenateStrings(VM *vm, Object **strings, int count);
+
+// returns the flat string for a string, rope or slice, building it if needed
+StringObject *flattenString(VM *vm, Object *string);
+
+// compares two strings, ropes or slices by their characters
+bool stringsEqual(VM *vm, Object *a, Object *b);
+
+void printObject(VM *vm, Value value);
 
 static inline bool isObjectType(Value value, ObjectType type)
 {
@@ -73,11 +188,20 @@ static inline bool isObjectType(Value value, ObjectType type)
 #define OBJ_TYPE(value) (AS_OBJECT(value)->type)
 
 #define IS_CLOSURE(value) isObjectType(value, OBJECT_CLOSURE)
+#define IS_COROUTINE(value) isObjectType(value, OBJECT_COROUTINE)
+#define IS_FILE(value) isObjectType(value, OBJECT_FILE)
 #define IS_FUNCTION(value) isObjectType(value, OBJECT_FUNCTION)
 #define IS_NATIVE(value) isObjectType(value, OBJECT_NATIVE);
+#define IS_ROPE(value) isObjectType(value, OBJECT_ROPE)
+#define IS_SLICE(value) isObjectType(value, OBJECT_SLICE)
 #define IS_STRING(value) isObjectType(value, OBJECT_STRING)
 
+// true for every value that behaves like a string in Lox: flat strings, ropes and slices
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value) || IS_SLICE(value))
+
 #define AS_CLOSURE(value) ((ClosureObject *)AS_OBJECT(value))
+#define AS_COROUTINE(value) ((CoroutineObject *)AS_OBJECT(value))
+#define AS_FILE(value) ((FileObject *)AS_OBJECT(value))
 
 // takes pointer to a value of type function and returns FunctionObject* pointer
 #define AS_FUNCTION(value) ((FunctionObject *)AS_OBJECT(value))
@@ -85,6 +209,9 @@ static inline bool isObjectType(Value value, ObjectType type)
 // takes a pointer to a value of type NativeObject and extracts the C function pointer from it
 #define AS_NATIVE(value) (((NativeObject *)AS_OBJECT(value))->function);
 
+#define AS_ROPE(value) ((RopeObject *)AS_OBJECT(value))
+#define AS_SLICE(value) ((SliceObject *)AS_OBJECT(value))
+
 // takes pointer to a value of type string and returns StringObject* pointer
 #define AS_STRING(value) ((StringObject *)AS_OBJECT(value))
 
@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "object.h"
+#include "output.h"
+
+// writes all iovecs, retrying on partial writes and interrupts. An fd that someone else made
+// non-blocking is waited for until it takes more
+static void writeAll(int fd, struct iovec *parts, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, parts, count);
+        if (written < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                struct pollfd ready = {.fd = fd, .events = POLLOUT};
+                if (poll(&ready, 1, -1) < 0 && errno != EINTR)
+                    return;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        while (count > 0 && (size_t)written >= parts->iov_len)
+        {
+            written -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0)
+        {
+            parts->iov_base = (char *)parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+}
+
+void initOutput(OutputBuffer *output, int fd, FlushPolicy policy)
+{
+    output->fd = fd;
+    output->policy = policy;
+    output->flushThreshold = OUTPUT_BUFFER_SIZE / 4;
+    output->length = 0;
+    output->capacity = 0;
+    output->buffer = NULL;
+}
+
+// a line at a time needs little room, and a size-flushed buffer never holds more than its threshold
+static size_t bufferSize(OutputBuffer *output)
+{
+    switch (output->policy)
+    {
+    case FLUSH_LINE:
+        return OUTPUT_LINE_BUFFER_SIZE;
+    case FLUSH_SIZE:
+        return output->flushThreshold;
+    case FLUSH_EXIT:
+        break;
+    }
+    return OUTPUT_BUFFER_SIZE;
+}
+
+void flushOutput(OutputBuffer *output)
+{
+    // anything printed through stdio, like debug traces, has to come out first
+    fflush(stdout);
+    if (output->length == 0)
+        return;
+
+    struct iovec part = {output->buffer, output->length};
+    writeAll(output->fd, &part, 1);
+    output->length = 0;
+}
+
+void releaseOutput(OutputBuffer *output)
+{
+    flushOutput(output);
+    free(output->buffer);
+    output->buffer = NULL;
+    output->capacity = 0;
+}
+
+void writeOutput(OutputBuffer *output, const char *chars, size_t length)
+{
+    if (output->buffer == NULL)
+    {
+        output->capacity = bufferSize(output);
+        output->buffer = (char *)malloc(output->capacity);
+        if (output->buffer == NULL)
+            exit(1);
+    }
+
+    if (length > output->capacity - output->length)
+    {
+        // too big to buffer: send the buffered bytes and the new ones in a single writev
+        fflush(stdout);
+        struct iovec parts[2] = {{output->buffer, output->length}, {(void *)chars, length}};
+        writeAll(output->fd, parts, 2);
+        output->length = 0;
+        return;
+    }
+
+    memcpy(output->buffer + output->length, chars, length);
+    output->length += length;
+
+    switch (output->policy)
+    {
+    case FLUSH_LINE:
+        if (memchr(chars, '\n', length) != NULL)
+            flushOutput(output);
+        break;
+    case FLUSH_SIZE:
+        if (output->length >= output->flushThreshold)
+            flushOutput(output);
+        break;
+    case FLUSH_EXIT:
+        break;
+    }
+}
+
+static void writeCString(OutputBuffer *output, const char *chars)
+{
+    writeOutput(output, chars, strlen(chars));
+}
+
+static void writeFunction(OutputBuffer *output, FunctionObject *function)
+{
+    if (function->name == NULL)
+    {
+        writeCString(output, "<script>");
+        return;
+    }
+    writeCString(output, "<fn ");
+    writeOutput(output, function->name->chars, function->name->length);
+    writeCString(output, ">");
+}
+
+void writeValue(VM *vm, OutputBuffer *output, Value value)
+{
+    switch (value.type)
+    {
+    case VAL_BOOL:
+        writeCString(output, AS_BOOL(value) ? "true" : "false");
+        break;
+    case VAL_NIL:
+        writeCString(output, "nil");
+        break;
+    case VAL_NUMBER:
+    {
+        char number[NUMBER_FORMAT_SIZE];
+        writeOutput(output, number, formatNumber(AS_NUMBER(value), number));
+        break;
+    }
+    case VAL_OBJECT:
+        switch (OBJ_TYPE(value))
+        {
+        case OBJECT_CLOSURE:
+            writeFunction(output, AS_CLOSURE(value)->function);
+            break;
+        case OBJECT_COROUTINE:
+            writeCString(output, "<coroutine>");
+            break;
+        case OBJECT_FILE:
+            writeCString(output, "<file>");
+            break;
+        case OBJECT_FUNCTION:
+            writeFunction(output, AS_FUNCTION(value));
+            break;
+        case OBJECT_NATIVE:
+            writeCString(output, "<native fn>");
+            break;
+        case OBJECT_ROPE:
+        case OBJECT_SLICE:
+        case OBJECT_STRING:
+        {
+            int length;
+            const char *chars = stringChars(vm, AS_OBJECT(value), &length);
+            writeOutput(output, chars, length);
+            break;
+        }
+        }
+        break;
+    }
+}
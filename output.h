@@ -0,0 +1,41 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+#include "value.h"
+
+// the buffer is only allocated once something is written, in a size that suits the flush policy
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define OUTPUT_LINE_BUFFER_SIZE (4 * 1024)
+
+// decides when buffered output is written out
+typedef enum
+{
+    FLUSH_LINE, // after every complete line, for interactive use
+    FLUSH_SIZE, // once flushThreshold bytes are buffered
+    FLUSH_EXIT  // only when the buffer is full or the program is done
+} FlushPolicy;
+
+// output written by the VM is collected here and handed to the OS in large writes
+typedef struct
+{
+    int fd;
+    FlushPolicy policy;
+    size_t flushThreshold; // used by FLUSH_SIZE
+    size_t length;
+    size_t capacity;
+    char *buffer; // NULL until the first write
+} OutputBuffer;
+
+// sets up an output that has no buffer yet, like a new VM's or one that was released
+void initOutput(OutputBuffer *output, int fd, FlushPolicy policy);
+
+// flushes the output and frees its buffer, so an idle VM doesn't hold on to it. The next write allocates it again
+void releaseOutput(OutputBuffer *output);
+void writeOutput(OutputBuffer *output, const char *chars, size_t length);
+
+// writes a value the same way printValue() prints it
+void writeValue(VM *vm, OutputBuffer *output, Value value);
+void flushOutput(OutputBuffer *output);
+
+#endif
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "prefork.h"
+
+bool readMemoryUsage(MemoryUsage *usage)
+{
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == NULL)
+        return false;
+
+    memset(usage, 0, sizeof(MemoryUsage));
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        size_t value;
+        if (sscanf(line, "Rss: %zu kB", &value) == 1)
+            usage->rss = value;
+        else if (sscanf(line, "Shared_Clean: %zu kB", &value) == 1)
+            usage->sharedClean = value;
+        else if (sscanf(line, "Shared_Dirty: %zu kB", &value) == 1)
+            usage->sharedDirty = value;
+        else if (sscanf(line, "Private_Clean: %zu kB", &value) == 1)
+            usage->privateClean = value;
+        else if (sscanf(line, "Private_Dirty: %zu kB", &value) == 1)
+            usage->privateDirty = value;
+    }
+    fclose(file);
+    return true;
+}
+
+// does what the workers would otherwise each do to objects they share: compile lazy bodies and flatten ropes
+static void finishHeap(VM *vm)
+{
+#ifdef LAZY_COMPILE
+    // compiling a body creates the functions nested in it. They are compiled on the next pass,
+    // which only looks at the objects the previous one created, so every function is only tried once
+    Object *end = NULL;
+    while (vm->objects != end)
+    {
+        Object *start = vm->objects;
+        for (Object *object = start; object != end; object = object->next)
+        {
+            if (object->type == OBJECT_FUNCTION && ((FunctionObject *)object)->source != NULL)
+                compileFunction(vm, (FunctionObject *)object);
+        }
+        end = start;
+    }
+#endif
+
+    for (Object *object = vm->objects; object != NULL; object = object->next)
+    {
+        if (object->type == OBJECT_ROPE && ((RopeObject *)object)->flat == NULL)
+            flattenString(vm, object);
+    }
+
+    // the children of the ropes and whatever else the scripts left behind don't need to be shared
+    collectGarbage(vm);
+}
+
+static void runWorker(VM *vm, const char *function, int index, int workerCount, int requestCount, int reportFd)
+{
+    PreforkWorker report;
+    memset(&report, 0, sizeof(PreforkWorker));
+    report.pid = getpid();
+
+    FunctionHandle handle;
+    bool isFound = findFunction(vm, function, &handle);
+    if (!isFound)
+        fprintf(stderr, "Undefined function '%s'.\n", function);
+    for (int request = index; request < requestCount; request += workerCount)
+    {
+        Value argument = NUMBER_VAL(request);
+        Value result;
+        // whatever the request allocates is freed in one go afterwards, the frozen objects and the globals the scripts set stay
+        beginRegion(vm);
+        if (!isFound || callHandle(vm, &handle, 1, &argument, &result) != INTERPRET_OK)
+            report.failedCount++;
+        endRegion(vm);
+        report.requestCount++;
+    }
+
+    flushOutput(&vm->output);
+    readMemoryUsage(&report.usage);
+
+    // less than PIPE_BUF bytes, so the reports of different workers never interleave
+    if (write(reportFd, &report, sizeof(PreforkWorker)) != sizeof(PreforkWorker))
+        _exit(1);
+    _exit(0);
+}
+
+bool runPrefork(VM *vm, const char *function, int workerCount, int requestCount, PreforkWorker *workers)
+{
+    finishHeap(vm);
+    freezeObjects(vm);
+
+    // anything still buffered would be printed once by every worker
+    flushOutput(&vm->output);
+
+    int reports[2];
+    if (pipe(reports) != 0)
+        return false;
+
+    bool succeeded = true;
+    int started = 0;
+    for (; started < workerCount; started++)
+    {
+        memset(&workers[started], 0, sizeof(PreforkWorker));
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(reports[0]);
+            runWorker(vm, function, started, workerCount, requestCount, reports[1]);
+        }
+        if (pid < 0)
+        {
+            fprintf(stderr, "Failed to fork a worker.\n");
+            succeeded = false;
+            break;
+        }
+        workers[started].pid = pid;
+    }
+    close(reports[1]);
+
+    PreforkWorker report;
+    while (read(reports[0], &report, sizeof(PreforkWorker)) == sizeof(PreforkWorker))
+    {
+        for (int i = 0; i < started; i++)
+        {
+            if (workers[i].pid == report.pid)
+                workers[i] = report;
+        }
+    }
+    close(reports[0]);
+
+    for (int i = 0; i < started; i++)
+    {
+        int status;
+        if (waitpid(workers[i].pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            succeeded = false;
+    }
+    return succeeded;
+}
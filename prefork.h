@@ -0,0 +1,37 @@
+#ifndef clox_prefork_h
+#define clox_prefork_h
+
+#include <sys/types.h>
+
+#include "common.h"
+#include "vm.h"
+
+// memory of a process as /proc/<pid>/smaps_rollup reports it, in kilobytes
+typedef struct
+{
+    size_t rss;
+    size_t sharedClean;
+    size_t sharedDirty;  // written before the fork and still shared with the parent
+    size_t privateClean;
+    size_t privateDirty; // the pages a worker had to copy, or allocated itself
+} MemoryUsage;
+
+bool readMemoryUsage(MemoryUsage *usage);
+
+typedef struct
+{
+    pid_t pid;
+    int requestCount;
+    int failedCount;
+    MemoryUsage usage; // measured by the worker once it handled its last request
+} PreforkWorker;
+
+/*
+finishes the VM's heap and freezes it, then forks workerCount workers that share it copy-on-write.
+requests 0 to requestCount - 1 are spread over the workers. Each worker calls the global function
+with the request's number, every call in a region of its own, and reports back how much memory it ended up with.
+returns once every worker has exited. The VM itself is left frozen.
+*/
+bool runPrefork(VM *vm, const char *function, int workerCount, int requestCount, PreforkWorker *workers);
+
+#endif
@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "records.h"
+
+// a record is passed the way substring() would pass it: long ones share the block, short ones are copied
+static Value makeRecord(VM *vm, StringObject *block, const char *chars, int length)
+{
+    if (length < SLICE_MIN_LENGTH)
+        return OBJECT_VAL(copyString(vm, chars, length));
+    return OBJECT_VAL(newSlice(vm, (Object *)block, chars, length));
+}
+
+// reads what the input has ready, as much as fits into the block. Returns the new end of the data or -1 on errors
+static int readBlock(int fd, StringObject *block, int end, bool *isAtEnd)
+{
+    for (;;)
+    {
+        ssize_t count = read(fd, block->chars + end, block->length - end);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return -1;
+        if (count == 0)
+        {
+            // nothing refers to the rest, but it shouldn't be left uninitialized
+            memset(block->chars + end, 0, block->length - end);
+            *isAtEnd = true;
+        }
+        return end + (int)count;
+    }
+}
+
+bool runRecords(VM *vm, FunctionHandle *handler, int fd, char delimiter, bool useRegions, RecordStats *stats)
+{
+    stats->recordCount = 0;
+    stats->byteCount = 0;
+
+    Value records[RECORD_BATCH];
+    Value results[RECORD_BATCH];
+
+    // the block only has to stay alive as long as the records sliced out of it, but while it is
+    // being read and cut up, nothing in the VM refers to it yet
+    StringObject *block = newBufferString(vm, RECORD_BLOCK_SIZE);
+    int pin = pinValue(vm, OBJECT_VAL(block));
+    int start = 0;
+    int end = 0;
+    bool isAtEnd = false;
+
+    bool succeeded = true;
+    while (succeeded && !isAtEnd)
+    {
+        if (end == block->length)
+        {
+            // the unfinished record at the end moves to the start of a new block, which has to be
+            // bigger if the record already filled most of this one
+            int rest = end - start;
+            int size = rest > block->length / 2 ? block->length * 2 : block->length;
+            StringObject *next = newBufferString(vm, size);
+            memcpy(next->chars, block->chars + start, rest);
+            unpinValue(vm, pin);
+            block = next;
+            pin = pinValue(vm, OBJECT_VAL(block));
+            start = 0;
+            end = rest;
+
+            // the handler's calls and loops are the only other safe points. A handler without any
+            // would never get to collect the blocks it is done with
+            if (vm->bytesAllocated > vm->nextGC)
+                collectGarbage(vm);
+        }
+
+        end = readBlock(fd, block, end, &isAtEnd);
+        if (end < 0)
+        {
+            fprintf(stderr, "Failed to read records.\n");
+            succeeded = false;
+            break;
+        }
+
+        // hand over every complete record read so far, a batch at a time
+        int count;
+        do
+        {
+            // the records are made inside the region too, so they go with the rest of the batch's objects
+            if (useRegions)
+                beginRegion(vm);
+            int consumed = start;
+            count = 0;
+            while (count < RECORD_BATCH)
+            {
+                const char *chars = block->chars + start;
+                const char *delimiterAt = memchr(chars, delimiter, end - start);
+                int length = delimiterAt != NULL ? (int)(delimiterAt - chars) : end - start;
+                if (delimiterAt == NULL && (!isAtEnd || length == 0))
+                    break;
+
+                records[count++] = makeRecord(vm, block, chars, length);
+                start += delimiterAt != NULL ? length + 1 : length;
+            }
+            if (count == 0)
+            {
+                endRegion(vm);
+                break;
+            }
+
+            int handled = 0;
+            succeeded = callBatch(vm, handler, count, 1, records, results, &handled) == INTERPRET_OK;
+            endRegion(vm);
+            stats->recordCount += handled;
+            stats->byteCount += start - consumed;
+        } while (succeeded && count == RECORD_BATCH);
+    }
+
+    unpinValue(vm, pin);
+    return succeeded;
+}
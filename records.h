@@ -0,0 +1,31 @@
+#ifndef clox_records_h
+#define clox_records_h
+
+#include <stddef.h>
+
+#include "common.h"
+#include "vm.h"
+
+// input is read in blocks of this many bytes. A block grows for records that don't fit
+#define RECORD_BLOCK_SIZE (1024 * 1024)
+
+// the handler is called with up to this many records per VM entry, see callBatch()
+#define RECORD_BATCH 1024
+
+typedef struct
+{
+    size_t recordCount;
+    size_t byteCount; // input read up to the last record handed over, delimiters included
+} RecordStats;
+
+/*
+reads records ending in delimiter from fd and calls the handler with each of them, delimiter left out.
+the last record doesn't need a delimiter. Input is read straight into big string objects and records
+are passed as slices of them, only short ones are copied.
+with useRegions, every batch runs in a region of its own, see beginRegion(): the records and whatever the
+handler allocates are freed when the batch is done.
+returns false once the handler fails or reading does. stats gets what was handled until then
+*/
+bool runRecords(VM *vm, FunctionHandle *handler, int fd, char delimiter, bool useRegions, RecordStats *stats);
+
+#endif
@@ -1,29 +1,68 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "common.h"
 #include "scanner.h"
 
-typedef struct
+void initScanner(Scanner *scanner, const char *sourceCode, int line)
+{
+    scanner->start = sourceCode;
+    scanner->current = sourceCode;
+    scanner->end = sourceCode + strlen(sourceCode);
+    scanner->line = line;
+}
+
+/*
+the hot loops of the scanner (whitespace, strings, identifiers and numbers) look at
+16 bytes at once with SSE2: each byte is classified in parallel, the resulting bitmask
+tells how far the run goes, and newlines are counted with a popcount.
+the last few bytes of the source, and builds without SSE2, use the plain loops.
+*/
+#ifdef __SSE2__
+#define CHUNK_SIZE 16
+
+static inline __m128i loadChunk(const char *p)
+{
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+// bit i is set if byte i equals c
+static inline uint32_t matchChar(__m128i chunk, char c)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+}
+
+// bit i is set if byte i lies in [low, high].
+// SSE2 has no unsigned byte compare, so flip the sign bits and compare signed
+static inline uint32_t matchRange(__m128i chunk, char low, char high)
 {
-    const char *start;   // beginning of the lexeme being scanned
-    const char *current; // current character
-    int line;
-} Scanner;
+    __m128i offset = _mm_sub_epi8(chunk, _mm_set1_epi8(low));
+    __m128i flipped = _mm_xor_si128(offset, _mm_set1_epi8((char)0x80));
+    __m128i limit = _mm_set1_epi8((char)((high - low + 1) ^ 0x80));
+    return (uint32_t)_mm_movemask_epi8(_mm_cmplt_epi8(flipped, limit));
+}
 
-Scanner scanner;
+static inline uint32_t matchIdentifierChars(__m128i chunk)
+{
+    // setting bit 5 maps upper case letters to lower case ones and nothing else into a-z
+    __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+    return matchRange(lower, 'a', 'z') | matchRange(chunk, '0', '9') | matchChar(chunk, '_');
+}
 
-void initScanner(const char *sourceCode)
+static inline int countLines(uint32_t newlines, int count)
 {
-    scanner.start = sourceCode;
-    scanner.current = sourceCode;
-    scanner.line = 1;
+    return __builtin_popcount(newlines & ((1u << count) - 1));
 }
+#endif
 
-static char advance()
+static char advance(Scanner *scanner)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
 }
 
 static bool isAlpha(char c)
@@ -33,9 +72,9 @@ static bool isAlpha(char c)
             c == '_');
 }
 
-static bool isAtEnd()
+static bool isAtEnd(Scanner *scanner)
 {
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
 static bool isDigit(char c)
@@ -43,56 +82,64 @@ static bool isDigit(char c)
     return c >= '0' && c <= '9';
 }
 
-static bool match(char expected)
+static bool match(Scanner *scanner, char expected)
 {
-    if (isAtEnd())
+    if (isAtEnd(scanner))
         return false;
 
-    if (*scanner.current != expected)
+    if (*scanner->current != expected)
         return false;
 
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static char peek()
+static char peek(Scanner *scanner)
 {
-    return *scanner.current;
+    return *scanner->current;
 }
 
-static char peekNext()
+static char peekNext(Scanner *scanner)
 {
-    if (isAtEnd())
+    if (isAtEnd(scanner))
         return '\0';
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
-// advance the scanner past any leading whitespace or comments
-static void skipWhiteSpace()
+// advance the scanner past spaces, tabs and newlines
+static void skipBlanks(Scanner *scanner)
 {
+#ifdef __SSE2__
+    while (scanner->end - scanner->current >= CHUNK_SIZE)
+    {
+        __m128i chunk = loadChunk(scanner->current);
+        uint32_t newlines = matchChar(chunk, '\n');
+        uint32_t blanks = newlines | matchChar(chunk, ' ') | matchChar(chunk, '\t') | matchChar(chunk, '\r');
+        uint32_t others = ~blanks & 0xffff;
+        if (others != 0)
+        {
+            int count = __builtin_ctz(others);
+            scanner->line += countLines(newlines, count);
+            scanner->current += count;
+            return;
+        }
+        scanner->line += __builtin_popcount(newlines);
+        scanner->current += CHUNK_SIZE;
+    }
+#endif
+
     for (;;)
     {
-        char c = peek();
-        switch (c)
+        switch (peek(scanner))
         {
         case ' ':
         case '\r':
         case '\t':
-            advance();
+            advance(scanner);
             break;
         case '\n':
-            scanner.line++;
-            advance();
-            break;
-        case '/':
-            if (peekNext() == '/')
-            {
-                // A comment goes until the end of the line
-                while (peek() != '\n' && !isAtEnd())
-                    advance();
-            }
-            else
-                return;
+            scanner->line++;
+            advance(scanner);
             break;
         default:
             return;
@@ -100,11 +147,28 @@ static void skipWhiteSpace()
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char *rest, TokenType type)
+// advance the scanner past any leading whitespace or comments
+static void skipWhiteSpace(Scanner *scanner)
+{
+    for (;;)
+    {
+        skipBlanks(scanner);
+        if (peek(scanner) == '/' && peekNext(scanner) == '/')
+        {
+            // A comment goes until the end of the line. memchr scans for it many bytes at a time
+            const char *newline = memchr(scanner->current, '\n', scanner->end - scanner->current);
+            scanner->current = newline != NULL ? newline : scanner->end;
+            continue;
+        }
+        return;
+    }
+}
+
+static TokenType checkKeyword(Scanner *scanner, int start, int length, const char *rest, TokenType type)
 {
     // check if identifier is same length as keyword & if it matches the keyword name
-    if ((scanner.current - scanner.start == start + length) &&
-        memcmp(scanner.start + start, rest, length) == 0)
+    if ((scanner->current - scanner->start == start + length) &&
+        memcmp(scanner->start + start, rest, length) == 0)
         return type;
 
     return TOKEN_IDENTIFIER;
@@ -114,181 +178,316 @@ static TokenType checkKeyword(int start, int length, const char *rest, TokenType
 function to check if the identifier is any of the reserved keywords
 uses a trie like logic to check character by character if the identifier is a keyword
 */
-static TokenType getIdentifierType()
+static TokenType getIdentifierType(Scanner *scanner)
 {
-    switch (scanner.start[0])
+    switch (scanner->start[0])
     {
     case 'a':
-        return checkKeyword(1, 2, "nd", TOKEN_AND);
+        return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
     case 'c':
-        return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+        return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
     case 'e':
-        return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+        return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
     case 'f':
-        if (scanner.current - scanner.start > 1) // check if there are more chars in the identifier
+        if (scanner->current - scanner->start > 1) // check if there are more chars in the identifier
         {
-            switch (scanner.start[1])
+            switch (scanner->start[1])
             {
             case 'a':
-                return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+                return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
             case 'o':
-                return checkKeyword(2, 1, "r", TOKEN_FOR);
+                return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
             case 'u':
-                return checkKeyword(2, 1, "n", TOKEN_FUN);
+                return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
             }
         }
+        break;
     case 'i':
-        return checkKeyword(1, 1, "f", TOKEN_IF);
+        return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
     case 'n':
-        return checkKeyword(1, 2, "il", TOKEN_NIL);
+        return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
     case 'o':
-        return checkKeyword(1, 1, "r", TOKEN_OR);
+        return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
     case 'p':
-        return checkKeyword(1, 4, "rint", TOKEN_PRINT);
+        return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
     case 'r':
-        return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+        return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
     case 's':
-        return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+        return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
     case 't':
-        if (scanner.current - scanner.start > 1)
+        if (scanner->current - scanner->start > 1)
         {
-            switch (scanner.start[1])
+            switch (scanner->start[1])
             {
             case 'h':
-                return checkKeyword(2, 2, "is", TOKEN_THIS);
+                return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
             case 'r':
-                return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+                return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
             }
         }
+        break;
     case 'v':
-        return checkKeyword(1, 2, "ar", TOKEN_VAR);
+        return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
     case 'w':
-        return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+    case 'y':
+        return checkKeyword(scanner, 1, 4, "ield", TOKEN_YIELD);
     }
     return TOKEN_IDENTIFIER;
 }
 
-static Token createToken(TokenType type)
+static Token createToken(Scanner *scanner, TokenType type)
 {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token createErrorToken(const char *message)
+static Token createErrorToken(Scanner *scanner, const char *message)
 {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static Token createIdentifierToken()
+static Token createIdentifierToken(Scanner *scanner)
 {
-    while (isAlpha(peek()) || isDigit(peek()))
-        advance();
-    return createToken(getIdentifierType());
+#ifdef __SSE2__
+    while (scanner->end - scanner->current >= CHUNK_SIZE)
+    {
+        uint32_t others = ~matchIdentifierChars(loadChunk(scanner->current)) & 0xffff;
+        if (others != 0)
+        {
+            scanner->current += __builtin_ctz(others);
+            return createToken(scanner, getIdentifierType(scanner));
+        }
+        scanner->current += CHUNK_SIZE;
+    }
+#endif
+
+    while (isAlpha(peek(scanner)) || isDigit(peek(scanner)))
+        advance(scanner);
+    return createToken(scanner, getIdentifierType(scanner));
 }
 
-static Token createNumberToken()
+static void skipDigits(Scanner *scanner)
 {
-    while (isDigit(peek()))
-        advance();
+#ifdef __SSE2__
+    while (scanner->end - scanner->current >= CHUNK_SIZE)
+    {
+        uint32_t others = ~matchRange(loadChunk(scanner->current), '0', '9') & 0xffff;
+        if (others != 0)
+        {
+            scanner->current += __builtin_ctz(others);
+            return;
+        }
+        scanner->current += CHUNK_SIZE;
+    }
+#endif
+
+    while (isDigit(peek(scanner)))
+        advance(scanner);
+}
+
+static Token createNumberToken(Scanner *scanner)
+{
+    skipDigits(scanner);
 
     // see if there is a fractional part
-    if (peek() == '.' && isDigit(peekNext()))
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner)))
     {
         // consume the '.'
-        advance();
+        advance(scanner);
 
-        while (isDigit(peek()))
-            advance();
+        skipDigits(scanner);
     }
 
-    return createToken(TOKEN_NUMBER);
+    return createToken(scanner, TOKEN_NUMBER);
 }
 
-static Token createStringToken()
+static Token createStringToken(Scanner *scanner)
 {
-    while (peek() != '"' && !isAtEnd())
+#ifdef __SSE2__
+    while (scanner->end - scanner->current >= CHUNK_SIZE)
+    {
+        __m128i chunk = loadChunk(scanner->current);
+        uint32_t quotes = matchChar(chunk, '"');
+        uint32_t newlines = matchChar(chunk, '\n');
+        if (quotes != 0)
+        {
+            int count = __builtin_ctz(quotes);
+            scanner->line += countLines(newlines, count);
+            scanner->current += count;
+            break;
+        }
+        scanner->line += __builtin_popcount(newlines);
+        scanner->current += CHUNK_SIZE;
+    }
+#endif
+
+    while (peek(scanner) != '"' && !isAtEnd(scanner))
     {
-        if (peek() == '\n')
-            scanner.line++;
-        advance();
+        if (peek(scanner) == '\n')
+            scanner->line++;
+        advance(scanner);
     }
 
-    if (isAtEnd())
-        return createErrorToken("Unterminated string.");
+    if (isAtEnd(scanner))
+        return createErrorToken(scanner, "Unterminated string.");
+
+    advance(scanner);
+    return createToken(scanner, TOKEN_STRING);
+}
 
-    advance();
-    return createToken(TOKEN_STRING);
+/*
+moves the scanner past the closing '}' of a function body, starting right after the '('
+of its parameter list. Only braces, strings and comments matter for finding the end,
+so this is a lot cheaper than scanning tokens.
+returns the end of the body, or NULL and leaves the scanner where it was if there is
+no well formed body. The compiler then reports the error by compiling it.
+*/
+const char *skipFunctionBody(Scanner *scanner)
+{
+    const char *current = scanner->current;
+    int line = scanner->line;
+    int depth = 0;
+
+    for (;;)
+    {
+#ifdef __SSE2__
+        // jump over everything that can't change the nesting
+        while (scanner->end - current >= CHUNK_SIZE)
+        {
+            __m128i chunk = loadChunk(current);
+            uint32_t newlines = matchChar(chunk, '\n');
+            uint32_t special = matchChar(chunk, '{') | matchChar(chunk, '}') | matchChar(chunk, '"') |
+                               matchChar(chunk, '/') | matchChar(chunk, ';');
+            if (special != 0)
+            {
+                int count = __builtin_ctz(special);
+                line += countLines(newlines, count);
+                current += count;
+                break;
+            }
+            line += __builtin_popcount(newlines);
+            current += CHUNK_SIZE;
+        }
+#endif
+
+        if (current == scanner->end)
+            return NULL;
+
+        switch (*current++)
+        {
+        case '\n':
+            line++;
+            break;
+        case '{':
+            depth++;
+            break;
+        case '}':
+            if (depth == 0)
+                return NULL;
+            if (--depth == 0)
+            {
+                scanner->current = current;
+                scanner->line = line;
+                return current;
+            }
+            break;
+        case ';':
+            // a statement before the body has started
+            if (depth == 0)
+                return NULL;
+            break;
+        case '"':
+            while (current < scanner->end && *current != '"')
+            {
+                if (*current == '\n')
+                    line++;
+                current++;
+            }
+            if (current == scanner->end)
+                return NULL;
+            current++;
+            break;
+        case '/':
+            if (*current == '/')
+            {
+                const char *newline = memchr(current, '\n', scanner->end - current);
+                current = newline != NULL ? newline : scanner->end;
+            }
+            break;
+        }
+    }
 }
 
 /*
 each time this function is called, a complete token is scanned.
 so, whenever function is executed, the scanner is always at the beginning of a new token.
-thus, scanner.start can point to current character so we can remember the start of the token
+thus, scanner->start can point to current character so we can remember the start of the token
 */
-Token scanToken()
+Token scanToken(Scanner *scanner)
 {
-    skipWhiteSpace();
+    skipWhiteSpace(scanner);
 
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
 
-    if (isAtEnd())
-        return createToken(TOKEN_EOF);
+    if (isAtEnd(scanner))
+        return createToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
     if (isAlpha(c))
-        return createIdentifierToken();
+        return createIdentifierToken(scanner);
     if (isDigit(c))
-        return createNumberToken();
+        return createNumberToken(scanner);
 
     switch (c)
     {
 
     // single character tokens
     case '(':
-        return createToken(TOKEN_LEFT_PAREN);
+        return createToken(scanner, TOKEN_LEFT_PAREN);
     case ')':
-        return createToken(TOKEN_RIGHT_PAREN);
+        return createToken(scanner, TOKEN_RIGHT_PAREN);
     case '{':
-        return createToken(TOKEN_LEFT_BRACE);
+        return createToken(scanner, TOKEN_LEFT_BRACE);
     case '}':
-        return createToken(TOKEN_RIGHT_BRACE);
+        return createToken(scanner, TOKEN_RIGHT_BRACE);
     case ';':
-        return createToken(TOKEN_SEMICOLON);
+        return createToken(scanner, TOKEN_SEMICOLON);
     case ',':
-        return createToken(TOKEN_COMMA);
+        return createToken(scanner, TOKEN_COMMA);
     case '.':
-        return createToken(TOKEN_DOT);
+        return createToken(scanner, TOKEN_DOT);
     case '-':
-        return createToken(TOKEN_MINUS);
+        return createToken(scanner, TOKEN_MINUS);
     case '+':
-        return createToken(TOKEN_PLUS);
+        return createToken(scanner, TOKEN_PLUS);
     case '/':
-        return createToken(TOKEN_SLASH);
+        return createToken(scanner, TOKEN_SLASH);
     case '*':
-        return createToken(TOKEN_STAR);
+        return createToken(scanner, TOKEN_STAR);
 
         // single or double character tokens
     case '!':
-        return createToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        return createToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-        return createToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        return createToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-        return createToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        return createToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-        return createToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        return createToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 
     // strings
     case '"':
-        return createStringToken();
+        return createStringToken(scanner);
     }
-    return createErrorToken("Unexpected character.");
+    return createErrorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
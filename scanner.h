@@ -48,6 +48,7 @@ typedef enum
     TOKEN_TRUE,
     TOKEN_VAR,
     TOKEN_WHILE,
+    TOKEN_YIELD,
 
     TOKEN_ERROR,
     TOKEN_EOF
@@ -61,7 +62,19 @@ typedef struct
     int line;
 } Token;
 
-void initScanner(const char *sourceCode);
-Token scanToken();
+// the scanner keeps no global state, so several sources can be scanned at the same time
+typedef struct
+{
+    const char *start;   // beginning of the lexeme being scanned
+    const char *current; // current character
+    const char *end;     // the terminating '\0'. Lets the scanner read 16 bytes at a time without running past it
+    int line;
+} Scanner;
+
+void initScanner(Scanner *scanner, const char *sourceCode, int line);
+Token scanToken(Scanner *scanner);
+
+// skips a function's parameters and body without producing tokens
+const char *skipFunctionBody(Scanner *scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "memory.h"
+#include "scheduler.h"
+
+// each worker's deque holds up to this many jobs. Must be a power of two
+#define DEQUE_CAPACITY 256
+
+// how many jobs an idle worker moves from the shared queue to its deque at once.
+// the rest of the batch is left for the other workers to steal
+#define REFILL_BATCH 32
+
+/*
+a Chase-Lev work-stealing deque. Only the owning worker pushes and pops at the bottom,
+other workers steal from the top. Top and bottom are only ever compared and swapped,
+so no lock is needed. The last job is raced for with a compare-and-swap on top.
+*/
+typedef struct
+{
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(Job *) jobs[DEQUE_CAPACITY];
+} Deque;
+
+struct Worker
+{
+    Deque deque;
+    Scheduler *scheduler;
+    pthread_t thread;
+    unsigned int seed; // picks where to start looking for a job to steal
+
+    VM *vm;             // the isolate jobs run in. Reused from one job to the next
+    bool isDirty;       // the isolate ran something since it was last reset
+    bool preludeLoaded; // the isolate's globals are exactly what the prelude defined
+};
+
+uint64_t monotonicNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static bool pushJob(Deque *deque, Job *job)
+{
+    long bottom = atomic_load(&deque->bottom);
+    if (bottom - atomic_load(&deque->top) >= DEQUE_CAPACITY)
+        return false;
+
+    atomic_store_explicit(&deque->jobs[bottom & (DEQUE_CAPACITY - 1)], job, memory_order_relaxed);
+    atomic_store(&deque->bottom, bottom + 1);
+    return true;
+}
+
+static Job *popJob(Deque *deque)
+{
+    // claim the bottom job first, then see if a thief got there before us
+    long bottom = atomic_load(&deque->bottom) - 1;
+    atomic_store(&deque->bottom, bottom);
+    long top = atomic_load(&deque->top);
+
+    if (top > bottom)
+    {
+        atomic_store(&deque->bottom, bottom + 1);
+        return NULL;
+    }
+
+    Job *job = atomic_load_explicit(&deque->jobs[bottom & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+    if (top == bottom)
+    {
+        // the last job goes to whoever moves top first
+        if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1))
+            job = NULL;
+        atomic_store(&deque->bottom, bottom + 1);
+    }
+    return job;
+}
+
+static Job *stealJob(Deque *deque)
+{
+    long top = atomic_load(&deque->top);
+    long bottom = atomic_load(&deque->bottom);
+    if (top >= bottom)
+        return NULL;
+
+    Job *job = atomic_load_explicit(&deque->jobs[top & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1))
+        return NULL;
+    return job;
+}
+
+static Job *findJob(Worker *worker)
+{
+    Job *job = popJob(&worker->deque);
+    if (job != NULL)
+        return job;
+
+    Scheduler *scheduler = worker->scheduler;
+    int start = rand_r(&worker->seed) % scheduler->workerCount;
+    for (int i = 0; i < scheduler->workerCount; i++)
+    {
+        Worker *victim = &scheduler->workers[(start + i) % scheduler->workerCount];
+        if (victim == worker)
+            continue;
+
+        job = stealJob(&victim->deque);
+        if (job != NULL)
+            return job;
+    }
+    return NULL;
+}
+
+/*
+moves a batch of jobs from the shared queue into the worker's deque, waiting for work if there is none.
+other idle workers are woken up so they can steal from the batch.
+returns false once the scheduler shuts down.
+*/
+static bool refillDeque(Worker *worker)
+{
+    Scheduler *scheduler = worker->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+
+    if (scheduler->queueCount == 0 && !scheduler->shuttingDown)
+    {
+        // after waking up, go back to stealing. Another worker may have taken the new jobs
+        pthread_cond_wait(&scheduler->workAvailable, &scheduler->lock);
+    }
+
+    if (scheduler->queueCount == 0 && scheduler->shuttingDown)
+    {
+        pthread_mutex_unlock(&scheduler->lock);
+        return false;
+    }
+
+    int moved = 0;
+    while (moved < REFILL_BATCH && scheduler->queueCount > 0)
+    {
+        Job *job = scheduler->queue[scheduler->queueHead];
+        if (!pushJob(&worker->deque, job))
+            break;
+        scheduler->queueHead = (scheduler->queueHead + 1) % scheduler->queueCapacity;
+        scheduler->queueCount--;
+        moved++;
+    }
+
+    if (moved > 1)
+        pthread_cond_broadcast(&scheduler->workAvailable);
+    pthread_mutex_unlock(&scheduler->lock);
+    return true;
+}
+
+// makes sure the isolate has nothing left over from the previous job but the prelude
+static bool preparePrelude(Worker *worker)
+{
+    if (worker->preludeLoaded)
+        return true;
+
+    if (worker->isDirty)
+        resetVM(worker->vm);
+    worker->isDirty = true;
+    if (worker->scheduler->prelude == NULL ||
+        interpretCode(worker->vm, worker->scheduler->prelude) != INTERPRET_OK)
+        return false;
+
+    worker->preludeLoaded = true;
+    return true;
+}
+
+static void runJob(Worker *worker, Job *job)
+{
+    VM *vm = worker->vm;
+    job->startedAt = monotonicNanos();
+    job->returned = NIL_VAL;
+
+    if (job->type == JOB_SCRIPT)
+    {
+        // every script starts from a clean isolate
+        if (worker->isDirty)
+            resetVM(vm);
+        worker->isDirty = true;
+        worker->preludeLoaded = false;
+        job->result = interpretCode(vm, job->source);
+    }
+    else if (!preparePrelude(worker))
+    {
+        job->result = INTERPRET_COMPILE_ERROR;
+    }
+    else
+    {
+        // whatever the call allocates is freed in one go afterwards, the prelude's objects stay
+        beginRegion(vm);
+        Value returned;
+        job->result = callFunction(vm, job->function, job->argCount, job->args, &returned);
+
+        // objects belong to the isolate's heap and can't be handed out
+        if (job->result == INTERPRET_OK && !IS_OBJECT(returned))
+            job->returned = returned;
+        endRegion(vm);
+    }
+
+    job->finishedAt = monotonicNanos();
+}
+
+static void finishJob(Scheduler *scheduler)
+{
+    long completed = atomic_fetch_add(&scheduler->completed, 1) + 1;
+    if (completed == atomic_load(&scheduler->submitted))
+    {
+        pthread_mutex_lock(&scheduler->lock);
+        pthread_cond_broadcast(&scheduler->allDone);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+}
+
+static void *runWorker(void *argument)
+{
+    Worker *worker = (Worker *)argument;
+    for (;;)
+    {
+        Job *job = findJob(worker);
+        if (job != NULL)
+        {
+            runJob(worker, job);
+            finishJob(worker->scheduler);
+            continue;
+        }
+
+        // the worker may wait a while for more jobs, its isolate doesn't need an output buffer meanwhile
+        releaseOutput(&worker->vm->output);
+        if (!refillDeque(worker))
+            return NULL;
+    }
+}
+
+void initScheduler(Scheduler *scheduler, int workerCount, const char *prelude, int outputFd)
+{
+    scheduler->workerCount = workerCount;
+    scheduler->prelude = prelude;
+    scheduler->outputFd = outputFd;
+
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->workAvailable, NULL);
+    pthread_cond_init(&scheduler->allDone, NULL);
+    scheduler->queue = NULL;
+    scheduler->queueCapacity = 0;
+    scheduler->queueHead = 0;
+    scheduler->queueCount = 0;
+    scheduler->shuttingDown = false;
+    atomic_init(&scheduler->submitted, 0);
+    atomic_init(&scheduler->completed, 0);
+
+    scheduler->workers = (Worker *)malloc(sizeof(Worker) * workerCount);
+    if (scheduler->workers == NULL)
+        exit(1);
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        Worker *worker = &scheduler->workers[i];
+        atomic_init(&worker->deque.top, 0);
+        atomic_init(&worker->deque.bottom, 0);
+        worker->scheduler = scheduler;
+        worker->seed = (unsigned int)i * 2654435761u + 1;
+
+        // workers come and go with the scheduler, so their VMs live on the heap
+        worker->vm = (VM *)malloc(sizeof(VM));
+        if (worker->vm == NULL)
+            exit(1);
+        initVM(worker->vm);
+        initOutput(&worker->vm->output, outputFd, FLUSH_EXIT);
+        worker->isDirty = false;
+        worker->preludeLoaded = false;
+    }
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        if (pthread_create(&scheduler->workers[i].thread, NULL, runWorker, &scheduler->workers[i]) != 0)
+            exit(1);
+    }
+}
+
+void submitJob(Scheduler *scheduler, Job *job)
+{
+    job->submittedAt = monotonicNanos();
+    atomic_fetch_add(&scheduler->submitted, 1);
+
+    pthread_mutex_lock(&scheduler->lock);
+    if (scheduler->queueCount == scheduler->queueCapacity)
+    {
+        // unwrap the ring buffer into a bigger one
+        int capacity = GROW_CAPACITY(scheduler->queueCapacity);
+        Job **queue = (Job **)malloc(sizeof(Job *) * capacity);
+        if (queue == NULL)
+            exit(1);
+        for (int i = 0; i < scheduler->queueCount; i++)
+            queue[i] = scheduler->queue[(scheduler->queueHead + i) % scheduler->queueCapacity];
+        free(scheduler->queue);
+        scheduler->queue = queue;
+        scheduler->queueCapacity = capacity;
+        scheduler->queueHead = 0;
+    }
+
+    scheduler->queue[(scheduler->queueHead + scheduler->queueCount) % scheduler->queueCapacity] = job;
+    scheduler->queueCount++;
+    pthread_cond_signal(&scheduler->workAvailable);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+void waitForJobs(Scheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    while (atomic_load(&scheduler->completed) < atomic_load(&scheduler->submitted))
+        pthread_cond_wait(&scheduler->allDone, &scheduler->lock);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+void freeScheduler(Scheduler *scheduler)
+{
+    waitForJobs(scheduler);
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->shuttingDown = true;
+    pthread_cond_broadcast(&scheduler->workAvailable);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (int i = 0; i < scheduler->workerCount; i++)
+    {
+        Worker *worker = &scheduler->workers[i];
+        pthread_join(worker->thread, NULL);
+        freeVM(worker->vm);
+        free(worker->vm);
+    }
+
+    free(scheduler->workers);
+    free(scheduler->queue);
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->workAvailable);
+    pthread_cond_destroy(&scheduler->allDone);
+}
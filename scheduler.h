@@ -0,0 +1,70 @@
+#ifndef clox_scheduler_h
+#define clox_scheduler_h
+
+#include <stdatomic.h>
+
+#include "common.h"
+#include "vm.h"
+
+#define JOB_MAX_ARGS 8
+
+typedef enum
+{
+    JOB_SCRIPT, // compile and run a script in a clean isolate
+    JOB_CALL    // call a function defined by the scheduler's prelude
+} JobType;
+
+// a unit of work. The caller owns the job and must keep it alive until waitForJobs() returns
+typedef struct Job
+{
+    JobType type;
+    const char *source;   // JOB_SCRIPT: the script to run
+    const char *function; // JOB_CALL: name of the global function to call
+    int argCount;
+    Value args[JOB_MAX_ARGS]; // numbers, booleans or nil. Objects can't cross isolates
+
+    InterpretResult result;
+    Value returned; // JOB_CALL: the function's result, or nil if it returned an object
+
+    // nanoseconds, for measuring latency
+    uint64_t submittedAt;
+    uint64_t startedAt;
+    uint64_t finishedAt;
+} Job;
+
+typedef struct Worker Worker;
+
+typedef struct
+{
+    int workerCount;
+    Worker *workers;
+    const char *prelude; // compiled into every isolate before it runs a JOB_CALL
+    int outputFd;        // where the isolates print to
+
+    // jobs submitted from outside go here first. Idle workers move them to their own deques
+    pthread_mutex_t lock;
+    pthread_cond_t workAvailable;
+    pthread_cond_t allDone;
+    Job **queue;
+    int queueCapacity;
+    int queueHead;
+    int queueCount;
+    bool shuttingDown;
+
+    atomic_long submitted;
+    atomic_long completed;
+} Scheduler;
+
+// starts workerCount threads, each owning a VM isolate that is recycled between jobs
+void initScheduler(Scheduler *scheduler, int workerCount, const char *prelude, int outputFd);
+void submitJob(Scheduler *scheduler, Job *job);
+
+// blocks until every submitted job has finished
+void waitForJobs(Scheduler *scheduler);
+
+// waits for the outstanding jobs, then stops the workers and frees their isolates
+void freeScheduler(Scheduler *scheduler);
+
+uint64_t monotonicNanos();
+
+#endif
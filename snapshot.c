@@ -0,0 +1,759 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC 0x584f4c43 // "CLOX"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+// an image holds raw object structs, so it can only be read by a build that lays them out the same way
+static uint64_t layoutHash()
+{
+    size_t sizes[] = {sizeof(Value), sizeof(Object), sizeof(Chunk), sizeof(ClosureObject), sizeof(CoroutineObject),
+                      sizeof(FileObject), sizeof(FunctionObject), sizeof(NativeObject), sizeof(RopeObject), sizeof(SliceObject),
+                      sizeof(StringObject), sizeof(Entry)};
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        hash = (hash ^ sizes[i]) * 1099511628211u;
+    return hash;
+}
+
+/*
+the image starts with this header. Every pointer in the image, in the header or inside an object,
+is stored as an offset from the start of the image, 0 standing for NULL.
+*/
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t layout;
+    uint64_t size;        // of the whole image
+    uint64_t objects;     // an array of the offsets of all objects
+    uint64_t objectCount;
+    uint64_t globals;     // an array of Entry
+    uint64_t globalCount;
+} SnapshotHeader;
+
+// where each object of the VM goes in the image, in an open addressing table keyed by the object's address
+typedef struct
+{
+    Object *object;
+    uint64_t offset;
+} Placement;
+
+typedef struct
+{
+    VM *vm;
+    uint8_t *bytes; // the image being built
+    size_t count;
+    size_t capacity;
+
+    Placement *placements;
+    uint64_t placementCapacity; // a power of two
+} SnapshotWriter;
+
+// reserves zeroed room at the end of the image and returns its offset. Moves the image around, so don't keep pointers into it
+static uint64_t reserve(SnapshotWriter *writer, size_t size)
+{
+    size = SNAPSHOT_ALIGN(size);
+    if (writer->capacity < writer->count + size)
+    {
+        while (writer->capacity < writer->count + size)
+            writer->capacity = writer->capacity < 4096 ? 4096 : writer->capacity * 2;
+        writer->bytes = (uint8_t *)realloc(writer->bytes, writer->capacity);
+        if (writer->bytes == NULL)
+            exit(1);
+    }
+
+    uint64_t offset = writer->count;
+    memset(writer->bytes + offset, 0, size);
+    writer->count += size;
+    return offset;
+}
+
+static uint64_t copyBytes(SnapshotWriter *writer, const void *bytes, size_t size)
+{
+    if (size == 0)
+        return 0;
+    uint64_t offset = reserve(writer, size);
+    memcpy(writer->bytes + offset, bytes, size);
+    return offset;
+}
+
+static Placement *findPlacement(SnapshotWriter *writer, Object *object)
+{
+    uint64_t index = (((uintptr_t)object >> 4) * 2654435761u) & (writer->placementCapacity - 1);
+    for (;;)
+    {
+        Placement *placement = &writer->placements[index];
+        if (placement->object == NULL || placement->object == object)
+            return placement;
+        index = (index + 1) & (writer->placementCapacity - 1);
+    }
+}
+
+// offsets are handed out as pointers, ready to be stored in the image's copy of an object
+static void *encodeObject(SnapshotWriter *writer, Object *object)
+{
+    if (object == NULL)
+        return NULL;
+    Placement *placement = findPlacement(writer, object);
+    if (placement->object == NULL)
+        return NULL;
+    return (void *)(uintptr_t)placement->offset;
+}
+
+static Value encodeValue(SnapshotWriter *writer, Value value)
+{
+    if (IS_OBJECT(value))
+        value.as.object = (Object *)encodeObject(writer, AS_OBJECT(value));
+    return value;
+}
+
+static size_t objectSize(Object *object)
+{
+    switch (object->type)
+    {
+    case OBJECT_CLOSURE:
+        return sizeof(ClosureObject);
+    case OBJECT_COROUTINE:
+        return sizeof(CoroutineObject);
+    case OBJECT_FILE:
+        return sizeof(FileObject);
+    case OBJECT_FUNCTION:
+        return sizeof(FunctionObject);
+    case OBJECT_NATIVE:
+        return sizeof(NativeObject);
+    case OBJECT_ROPE:
+        return sizeof(RopeObject);
+    case OBJECT_SLICE:
+        return sizeof(SliceObject);
+    case OBJECT_STRING:
+        return STRING_SIZE(((StringObject *)object)->length);
+    }
+    return 0;
+}
+
+// fills in the image's copy of an object. Its space has already been reserved at offset
+static bool writeObject(SnapshotWriter *writer, Object *object, uint64_t offset)
+{
+    // side arrays go first, since reserving room for them can move the image
+    uint64_t code = 0;
+    uint64_t lines = 0;
+    uint64_t constants = 0;
+    uint64_t source = 0;
+    if (object->type == OBJECT_FUNCTION)
+    {
+        FunctionObject *function = (FunctionObject *)object;
+        Chunk *chunk = &function->chunk;
+        code = copyBytes(writer, chunk->code, chunk->count * sizeof(uint8_t));
+        lines = copyBytes(writer, chunk->lines, chunk->count * sizeof(int));
+        if (chunk->constants.count > 0)
+        {
+            constants = reserve(writer, chunk->constants.count * sizeof(Value));
+            for (int i = 0; i < chunk->constants.count; i++)
+                ((Value *)(writer->bytes + constants))[i] = encodeValue(writer, chunk->constants.values[i]);
+        }
+        if (function->source != NULL)
+            source = copyBytes(writer, function->source, function->sourceLength + 1);
+    }
+
+    Object *copy = (Object *)(writer->bytes + offset);
+    memcpy(copy, object, objectSize(object));
+    copy->isRegion = false;
+    copy->isMapped = true;
+    copy->isFrozen = false;
+    copy->next = NULL;
+
+    switch (object->type)
+    {
+    case OBJECT_CLOSURE:
+    {
+        ClosureObject *closure = (ClosureObject *)copy;
+        closure->function = (FunctionObject *)encodeObject(writer, (Object *)closure->function);
+        break;
+    }
+    case OBJECT_COROUTINE:
+    {
+        CoroutineObject *coroutine = (CoroutineObject *)copy;
+        if (coroutine->stack != NULL)
+        {
+            fprintf(stderr, "Cannot snapshot a coroutine that has started.\n");
+            return false;
+        }
+        coroutine->function = (FunctionObject *)encodeObject(writer, (Object *)coroutine->function);
+        coroutine->resumer = (CoroutineObject *)encodeObject(writer, (Object *)coroutine->resumer);
+        break;
+    }
+    case OBJECT_FILE:
+        // the mapping belongs to this process, and the file may be gone or changed when the image is loaded
+        fprintf(stderr, "Cannot snapshot a file.\n");
+        return false;
+    case OBJECT_FUNCTION:
+    {
+        FunctionObject *function = (FunctionObject *)copy;
+        Chunk *chunk = &function->chunk;
+        function->name = (StringObject *)encodeObject(writer, (Object *)function->name);
+        chunk->code = (uint8_t *)(uintptr_t)code;
+        chunk->lines = (int *)(uintptr_t)lines;
+        chunk->capacity = chunk->count;
+        chunk->constants.values = (Value *)(uintptr_t)constants;
+        chunk->constants.capacity = chunk->constants.count;
+        chunk->arena = NULL;
+
+        // compiled code stays in the image. The source of a function that hasn't been compiled yet
+        // is copied to the heap when the image is loaded, the chunk is built there later
+        chunk->isLinked = source == 0;
+        chunk->segment = NULL;
+        function->source = (char *)(uintptr_t)source;
+        break;
+    }
+    case OBJECT_NATIVE:
+    {
+        // function pointers don't survive into another process. The native is found again by its name
+        NativeObject *native = (NativeObject *)copy;
+        native->function = NULL;
+        native->name = (StringObject *)encodeObject(writer, (Object *)native->name);
+        break;
+    }
+    case OBJECT_ROPE:
+    {
+        RopeObject *rope = (RopeObject *)copy;
+        rope->left = (Object *)encodeObject(writer, rope->left);
+        rope->right = (Object *)encodeObject(writer, rope->right);
+        rope->flat = (StringObject *)encodeObject(writer, (Object *)rope->flat);
+        break;
+    }
+    case OBJECT_SLICE:
+    {
+        // the characters are stored as an index into the owner's
+        SliceObject *slice = (SliceObject *)copy;
+        slice->chars = (const char *)(uintptr_t)(slice->chars - ((StringObject *)slice->owner)->chars);
+        slice->owner = (Object *)encodeObject(writer, slice->owner);
+        break;
+    }
+    case OBJECT_STRING:
+        break;
+    }
+    return true;
+}
+
+static bool writeImage(SnapshotWriter *writer)
+{
+    VM *vm = writer->vm;
+    reserve(writer, sizeof(SnapshotHeader));
+
+    // lay out the objects first, so references between them can be encoded in any order
+    uint64_t objectCount = 0;
+    for (Object *object = vm->objects; object != NULL; object = object->next)
+        objectCount++;
+
+    writer->placementCapacity = 16;
+    while (writer->placementCapacity < objectCount * 2)
+        writer->placementCapacity *= 2;
+    writer->placements = (Placement *)calloc(writer->placementCapacity, sizeof(Placement));
+    if (writer->placements == NULL)
+        exit(1);
+
+    uint64_t objects = reserve(writer, objectCount * sizeof(uint64_t));
+    uint64_t index = 0;
+    for (Object *object = vm->objects; object != NULL; object = object->next)
+    {
+        uint64_t offset = reserve(writer, objectSize(object));
+        Placement *placement = findPlacement(writer, object);
+        placement->object = object;
+        placement->offset = offset;
+        ((uint64_t *)(writer->bytes + objects))[index++] = offset;
+    }
+
+    for (Object *object = vm->objects; object != NULL; object = object->next)
+    {
+        if (!writeObject(writer, object, findPlacement(writer, object)->offset))
+            return false;
+    }
+
+    uint64_t globals = reserve(writer, vm->globals.count * sizeof(Entry));
+    uint64_t globalCount = 0;
+    for (int i = 0; i < vm->globals.capacity; i++)
+    {
+        if (vm->globals.control[i] < 0)
+            continue;
+        Entry *entry = &((Entry *)(writer->bytes + globals))[globalCount++];
+        entry->key = (StringObject *)encodeObject(writer, (Object *)vm->globals.entries[i].key);
+        entry->value = encodeValue(writer, vm->globals.entries[i].value);
+    }
+
+    SnapshotHeader *header = (SnapshotHeader *)writer->bytes;
+    header->magic = SNAPSHOT_MAGIC;
+    header->version = SNAPSHOT_VERSION;
+    header->layout = layoutHash();
+    header->size = writer->count;
+    header->objects = objects;
+    header->objectCount = objectCount;
+    header->globals = globals;
+    header->globalCount = globalCount;
+    return true;
+}
+
+bool saveSnapshot(VM *vm, const char *path)
+{
+    if (vm->frameCount > 0 || vm->coroutine != NULL || vm->region.isActive || vm->loop.taskCount > 0)
+    {
+        fprintf(stderr, "Cannot snapshot a VM that is busy.\n");
+        return false;
+    }
+
+    // only what the globals reach is worth keeping
+    collectGarbage(vm);
+
+    SnapshotWriter writer = {vm, NULL, 0, 0, NULL, 0};
+    bool succeeded = writeImage(&writer);
+
+    if (succeeded)
+    {
+        FILE *file = fopen(path, "wb");
+        if (file == NULL || fwrite(writer.bytes, 1, writer.count, file) != writer.count)
+        {
+            fprintf(stderr, "Failed to write snapshot \"%s\".\n", path);
+            succeeded = false;
+        }
+        if (file != NULL && fclose(file) != 0)
+            succeeded = false;
+    }
+
+    free(writer.bytes);
+    free(writer.placements);
+    return succeeded;
+}
+
+typedef struct
+{
+    uint8_t *base;
+    size_t size;
+    uint64_t *offsets; // the offsets of the image's objects in ascending order, to look references up in
+    uint64_t count;
+} ImageCheck;
+
+#define TYPE_BIT(type) (1u << (type))
+#define STRING_TYPES (TYPE_BIT(OBJECT_STRING) | TYPE_BIT(OBJECT_ROPE) | TYPE_BIT(OBJECT_SLICE))
+#define ANY_TYPE (~0u)
+
+static int compareOffsets(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+// whether count elements at offset lie inside the image. Written so that huge numbers from a corrupt image can't overflow
+static bool inImage(ImageCheck *check, uint64_t offset, uint64_t count, size_t elementSize, size_t alignment)
+{
+    return offset % alignment == 0 && offset <= check->size && count <= (check->size - offset) / elementSize;
+}
+
+// a corrupt image can hold any byte where a bool is expected
+static bool isBool(const bool *field)
+{
+    return *(const uint8_t *)field <= 1;
+}
+
+// a reference has to be the offset of one of the image's objects, of one of the given types
+static bool checkReference(ImageCheck *check, const void *stored, uint32_t types, bool isRequired)
+{
+    if (stored == NULL)
+        return !isRequired;
+
+    uint64_t offset = (uintptr_t)stored;
+    if (bsearch(&offset, check->offsets, check->count, sizeof(uint64_t), compareOffsets) == NULL)
+        return false;
+    return (TYPE_BIT(((Object *)(check->base + offset))->type) & types) != 0;
+}
+
+static bool checkValue(ImageCheck *check, Value value)
+{
+    switch (value.type)
+    {
+    case VAL_BOOL:
+        return isBool(&value.as.boolean);
+    case VAL_NIL:
+    case VAL_NUMBER:
+        return true;
+    case VAL_OBJECT:
+        return checkReference(check, AS_OBJECT(value), ANY_TYPE, true);
+    }
+    return false;
+}
+
+// whether an object fits in the image and has a type an image can hold. Its references are checked separately
+static bool checkObjectBounds(ImageCheck *check, uint64_t offset)
+{
+    if (offset < sizeof(SnapshotHeader) || !inImage(check, offset, 1, sizeof(Object), 16))
+        return false;
+
+    Object *object = (Object *)(check->base + offset);
+    if (object->next != NULL || !isBool(&object->isRegion) || !isBool(&object->isMapped) || !isBool(&object->isFrozen))
+        return false;
+
+    switch (object->type)
+    {
+    case OBJECT_CLOSURE:
+    case OBJECT_COROUTINE:
+    case OBJECT_FUNCTION:
+    case OBJECT_NATIVE:
+    case OBJECT_ROPE:
+    case OBJECT_SLICE:
+        return inImage(check, offset, 1, objectSize(object), 1);
+    case OBJECT_STRING:
+    {
+        StringObject *string = (StringObject *)object;
+        return string->length >= 0 && isBool(&string->isInterned) && inImage(check, offset, 1, STRING_SIZE(string->length), 1) &&
+               string->chars[string->length] == '\0';
+    }
+    case OBJECT_FILE:
+        break;
+    }
+    return false;
+}
+
+static bool checkObject(ImageCheck *check, Object *object)
+{
+    switch (object->type)
+    {
+    case OBJECT_CLOSURE:
+        return checkReference(check, ((ClosureObject *)object)->function, TYPE_BIT(OBJECT_FUNCTION), true);
+    case OBJECT_COROUTINE:
+    {
+        CoroutineObject *coroutine = (CoroutineObject *)object;
+        return coroutine->state >= COROUTINE_SUSPENDED && coroutine->state <= COROUTINE_DONE && isBool(&coroutine->isTask) &&
+               coroutine->frames == NULL && coroutine->stack == NULL &&
+               checkReference(check, coroutine->function, TYPE_BIT(OBJECT_FUNCTION), true) &&
+               checkReference(check, coroutine->resumer, TYPE_BIT(OBJECT_COROUTINE), false);
+    }
+    case OBJECT_FUNCTION:
+    {
+        FunctionObject *function = (FunctionObject *)object;
+        Chunk *chunk = &function->chunk;
+        if (!checkReference(check, function->name, TYPE_BIT(OBJECT_STRING), false))
+            return false;
+
+        if (chunk->arena != NULL || chunk->segment != NULL || !isBool(&chunk->isLinked) ||
+            chunk->isLinked != (function->source == NULL))
+            return false;
+
+        // an uncompiled function only has its source, which has to be a C string
+        if (function->source != NULL)
+        {
+            uint64_t source = (uintptr_t)function->source;
+            return chunk->count == 0 && chunk->constants.count == 0 && function->sourceLength >= 0 &&
+                   inImage(check, source, (uint64_t)function->sourceLength + 1, 1, 1) &&
+                   check->base[source + function->sourceLength] == '\0';
+        }
+
+        if (chunk->count <= 0 || chunk->constants.count < 0 || function->arity < 0 || function->maxSlots <= function->arity ||
+            !inImage(check, (uintptr_t)chunk->code, chunk->count, sizeof(uint8_t), 1) ||
+            !inImage(check, (uintptr_t)chunk->lines, chunk->count, sizeof(int), _Alignof(int)) ||
+            !inImage(check, (uintptr_t)chunk->constants.values, chunk->constants.count, sizeof(Value), _Alignof(Value)))
+            return false;
+
+        Value *constants = (Value *)(check->base + (uintptr_t)chunk->constants.values);
+        for (int i = 0; i < chunk->constants.count; i++)
+        {
+            if (!checkValue(check, constants[i]))
+                return false;
+        }
+        return true;
+    }
+    case OBJECT_NATIVE:
+        return checkReference(check, ((NativeObject *)object)->name, TYPE_BIT(OBJECT_STRING), true);
+    case OBJECT_ROPE:
+    {
+        RopeObject *rope = (RopeObject *)object;
+        if (rope->flat == NULL && (rope->left == NULL || rope->right == NULL))
+            return false;
+        return rope->length >= 0 && checkReference(check, rope->left, STRING_TYPES, false) &&
+               checkReference(check, rope->right, STRING_TYPES, false) &&
+               checkReference(check, rope->flat, TYPE_BIT(OBJECT_STRING), false);
+    }
+    case OBJECT_SLICE:
+    {
+        SliceObject *slice = (SliceObject *)object;
+        if (slice->length < 0 || !checkReference(check, slice->owner, TYPE_BIT(OBJECT_STRING), true))
+            return false;
+        StringObject *owner = (StringObject *)(check->base + (uintptr_t)slice->owner);
+        return (uintptr_t)slice->chars <= (uintptr_t)owner->length &&
+               (uint64_t)slice->length <= owner->length - (uintptr_t)slice->chars;
+    }
+    case OBJECT_FILE:
+    case OBJECT_STRING:
+        break;
+    }
+    return true;
+}
+
+/*
+makes sure every offset in the image points inside it, and every reference at an object of the right type,
+before anything is relocated. The bytecode itself is trusted like the compiler's
+*/
+static bool checkImage(uint8_t *base, size_t size)
+{
+    SnapshotHeader *header = (SnapshotHeader *)base;
+    ImageCheck check = {base, size, NULL, header->objectCount};
+    if (!inImage(&check, header->objects, header->objectCount, sizeof(uint64_t), sizeof(uint64_t)) ||
+        !inImage(&check, header->globals, header->globalCount, sizeof(Entry), _Alignof(Entry)))
+        return false;
+
+    uint64_t *objects = (uint64_t *)(base + header->objects);
+    check.offsets = (uint64_t *)malloc(check.count * sizeof(uint64_t) + 1);
+    if (check.offsets == NULL)
+        return false;
+    memcpy(check.offsets, objects, check.count * sizeof(uint64_t));
+    qsort(check.offsets, check.count, sizeof(uint64_t), compareOffsets);
+
+    bool isValid = true;
+    for (uint64_t i = 0; i < check.count && isValid; i++)
+    {
+        // an object listed twice would be linked into the VM twice
+        isValid = checkObjectBounds(&check, check.offsets[i]) && (i == 0 || check.offsets[i] != check.offsets[i - 1]);
+    }
+    for (uint64_t i = 0; i < check.count && isValid; i++)
+        isValid = checkObject(&check, (Object *)(base + objects[i]));
+
+    Entry *globals = (Entry *)(base + header->globals);
+    for (uint64_t i = 0; i < header->globalCount && isValid; i++)
+        isValid = checkReference(&check, globals[i].key, TYPE_BIT(OBJECT_STRING), true) && checkValue(&check, globals[i].value);
+
+    free(check.offsets);
+    return isValid;
+}
+
+/*
+an interned string of the image that the VM already has is replaced by the VM's own, so there is still only one
+string per text. Until the image's objects are linked into the VM, such a string points to its replacement with next.
+*/
+static bool isReplaced(Object *object)
+{
+    return object->type == OBJECT_STRING && !((StringObject *)object)->isInterned && object->next != NULL;
+}
+
+static Object *relocateObject(uint8_t *base, Object *stored)
+{
+    if (stored == NULL)
+        return NULL;
+    Object *object = (Object *)(base + (uintptr_t)stored);
+    return isReplaced(object) ? object->next : object;
+}
+
+static Value relocateValue(uint8_t *base, Value value)
+{
+    if (IS_OBJECT(value))
+        value.as.object = relocateObject(base, AS_OBJECT(value));
+    return value;
+}
+
+static void relocate(uint8_t *base, Object *object)
+{
+    switch (object->type)
+    {
+    case OBJECT_CLOSURE:
+    {
+        ClosureObject *closure = (ClosureObject *)object;
+        closure->function = (FunctionObject *)relocateObject(base, (Object *)closure->function);
+        break;
+    }
+    case OBJECT_COROUTINE:
+    {
+        CoroutineObject *coroutine = (CoroutineObject *)object;
+        coroutine->function = (FunctionObject *)relocateObject(base, (Object *)coroutine->function);
+        coroutine->resumer = (CoroutineObject *)relocateObject(base, (Object *)coroutine->resumer);
+        break;
+    }
+    case OBJECT_FUNCTION:
+    {
+        FunctionObject *function = (FunctionObject *)object;
+        Chunk *chunk = &function->chunk;
+        function->name = (StringObject *)relocateObject(base, (Object *)function->name);
+        if (chunk->count > 0)
+        {
+            chunk->code = base + (uintptr_t)chunk->code;
+            chunk->lines = (int *)(base + (uintptr_t)chunk->lines);
+        }
+        if (chunk->constants.count > 0)
+        {
+            chunk->constants.values = (Value *)(base + (uintptr_t)chunk->constants.values);
+            for (int i = 0; i < chunk->constants.count; i++)
+                chunk->constants.values[i] = relocateValue(base, chunk->constants.values[i]);
+        }
+        break;
+    }
+    case OBJECT_ROPE:
+    {
+        RopeObject *rope = (RopeObject *)object;
+        rope->left = relocateObject(base, rope->left);
+        rope->right = relocateObject(base, rope->right);
+        rope->flat = (StringObject *)relocateObject(base, (Object *)rope->flat);
+        break;
+    }
+    case OBJECT_SLICE:
+    {
+        SliceObject *slice = (SliceObject *)object;
+        slice->owner = relocateObject(base, slice->owner);
+        slice->chars = ((StringObject *)slice->owner)->chars + (uintptr_t)slice->chars;
+        break;
+    }
+    case OBJECT_NATIVE:
+        ((NativeObject *)object)->name = (StringObject *)relocateObject(base, (Object *)((NativeObject *)object)->name);
+        break;
+    case OBJECT_FILE:
+    case OBJECT_STRING:
+        break;
+    }
+}
+
+// points the image's natives at the VM's natives of the same name
+static bool resolveNatives(VM *vm, uint8_t *base, uint64_t *objects, uint64_t objectCount)
+{
+    for (uint64_t i = 0; i < objectCount; i++)
+    {
+        Object *object = (Object *)(base + objects[i]);
+        if (object->type != OBJECT_NATIVE)
+            continue;
+
+        NativeObject *native = (NativeObject *)object;
+        StringObject *name = (StringObject *)relocateObject(base, (Object *)native->name);
+        Value value;
+        if (!tableGet(&vm->globals, name, &value) || !IS_OBJECT(value) || AS_OBJECT(value)->type != OBJECT_NATIVE ||
+            ((NativeObject *)AS_OBJECT(value))->name != name)
+        {
+            fprintf(stderr, "Unknown native function '%s' in snapshot.\n", name->chars);
+            return false;
+        }
+        native->function = ((NativeObject *)AS_OBJECT(value))->function;
+    }
+    return true;
+}
+
+static uint8_t *mapImage(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    uint8_t *base = NULL;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(SnapshotHeader))
+    {
+        *size = (size_t)info.st_size;
+        base = (uint8_t *)mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED)
+            base = NULL;
+    }
+    close(fd);
+    return base;
+}
+
+bool loadSnapshot(VM *vm, const char *path)
+{
+    size_t size;
+    uint8_t *base = mapImage(path, &size);
+    if (base == NULL)
+    {
+        fprintf(stderr, "Failed to open snapshot \"%s\".\n", path);
+        return false;
+    }
+
+    SnapshotHeader *header = (SnapshotHeader *)base;
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION ||
+        header->layout != layoutHash() || header->size != size || !checkImage(base, size))
+    {
+        fprintf(stderr, "\"%s\" is not a snapshot of this version of clox.\n", path);
+        munmap(base, size);
+        return false;
+    }
+
+    uint64_t *objects = (uint64_t *)(base + header->objects);
+    for (uint64_t i = 0; i < header->objectCount; i++)
+    {
+        StringObject *string = (StringObject *)(base + objects[i]);
+        if (string->object.type != OBJECT_STRING || !string->isInterned)
+            continue;
+
+        StringObject *interned = tableFindString(&vm->strings, string->chars, string->length, string->hash);
+        if (interned != NULL)
+        {
+            string->isInterned = false;
+            string->object.next = (Object *)interned;
+        }
+    }
+
+    // the VM hasn't been touched so far, so it is left as it was if a native is missing
+    if (!resolveNatives(vm, base, objects, header->objectCount))
+    {
+        munmap(base, size);
+        return false;
+    }
+
+    // everything is relocated before the objects are linked, since linking them sets their next pointers
+    for (uint64_t i = 0; i < header->objectCount; i++)
+    {
+        Object *object = (Object *)(base + objects[i]);
+        if (!isReplaced(object))
+            relocate(base, object);
+    }
+
+    Entry *globals = (Entry *)(base + header->globals);
+    for (uint64_t i = 0; i < header->globalCount; i++)
+    {
+        globals[i].key = (StringObject *)relocateObject(base, (Object *)globals[i].key);
+        globals[i].value = relocateValue(base, globals[i].value);
+    }
+
+    for (uint64_t i = 0; i < header->objectCount; i++)
+    {
+        Object *object = (Object *)(base + objects[i]);
+        if (isReplaced(object))
+            continue;
+
+        if (object->type == OBJECT_FUNCTION)
+        {
+            // compileFunction() frees the source once it is done with it, so it has to be on the heap
+            FunctionObject *function = (FunctionObject *)object;
+            if (function->source != NULL)
+            {
+                const char *source = (const char *)(base + (uintptr_t)function->source);
+                function->source = ALLOCATE(vm, char, function->sourceLength + 1);
+                memcpy(function->source, source, function->sourceLength + 1);
+            }
+        }
+        else if (object->type == OBJECT_STRING && ((StringObject *)object)->isInterned)
+        {
+            tableAdd(vm, &vm->strings, (StringObject *)object, NIL_VAL);
+        }
+
+        object->next = vm->objects;
+        vm->objects = object;
+    }
+
+    for (uint64_t i = 0; i < header->globalCount; i++)
+        tableAdd(vm, &vm->globals, globals[i].key, globals[i].value);
+
+    // the mapping lives as long as the VM's code segments. It is only unmapped with them
+    CodeSegment *segment = ALLOCATE(vm, CodeSegment, 1);
+    segment->code = base;
+    segment->codeSize = size;
+    segment->codeUsed = size;
+    segment->data = NULL;
+    segment->dataSize = 0;
+    segment->constantsEnd = 0;
+    segment->linesStart = 0;
+    segment->functionCount = 0;
+    segment->next = vm->segments;
+    vm->segments = segment;
+    return true;
+}
@@ -0,0 +1,24 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+#include "vm.h"
+
+/*
+writes the VM's globals and every object they reach to an image file: strings, functions with their bytecode,
+closures, ropes and slices. Pointers are stored as offsets into the image, so it can be mapped at any address.
+natives are stored by the name they were defined with.
+only call this while the VM is idle: no code running, no tasks waiting and no region active.
+*/
+bool saveSnapshot(VM *vm, const char *path);
+
+/*
+maps an image written by saveSnapshot() into the VM and adds its globals. The objects are used right where
+they are in the private mapping instead of being allocated and rebuilt one by one. Only their pointers are
+adjusted to the address the image ended up at.
+natives are looked up by name among the VM's globals, so they have to be defined before the image is loaded.
+an image only loads into the same build of clox that wrote it.
+*/
+bool loadSnapshot(VM *vm, const char *path);
+
+#endif
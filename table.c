@@ -1,157 +1,327 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-// load factor for the hash table
-#define TABLE_MAX_LOAD 0.75
+// grow once live entries and tombstones take up 7/8 of the slots
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// shrink once less than 1/TABLE_SHRINK_RATIO of the slots hold live entries
+#define TABLE_SHRINK_RATIO 8
+
+// the hash is split in two: the high bits pick the group to start probing at,
+// the low 7 bits are stored in the control byte to filter candidates
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_FRAGMENT(hash) ((int8_t)((hash)&0x7f))
 
-// allocate array of empty buckets
-static void adjustCapacity(Table *table, int capacity)
+// returns a bitmask with bit i set if control byte i of the group equals byte
+static inline uint32_t matchByte(const int8_t *group, int8_t byte)
 {
-    // create a new array of desired capacity
-    Entry *newEntries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++)
+#ifdef __SSE2__
+    __m128i control = _mm_load_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
     {
-        newEntries[i].key = NULL;
-        newEntries[i].value = NIL_VAL;
+        if (group[i] == byte)
+            mask |= 1u << i;
     }
+    return mask;
+#endif
+}
 
-    // reset table count and calculate again while inserting
-    // this will give new count without tombstones
-    table->count = 0;
-
-    // insert all entries from old array to new array
-    for (int i = 0; i < table->capacity; i++)
+// returns a bitmask of the slots in the group that are empty or deleted
+static inline uint32_t matchFree(const int8_t *group)
+{
+#ifdef __SSE2__
+    // free slots are exactly the ones with the sign bit set
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
     {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL)
-            continue;
-
-        Entry *dest = findEntry(entry->key, newEntries, capacity);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        if (group[i] < 0)
+            mask |= 1u << i;
     }
+    return mask;
+#endif
+}
 
-    // release memory for old entries array
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+static inline int firstBit(uint32_t mask)
+{
+    return __builtin_ctz(mask);
+}
 
-    // update hash table to point to new array
-    table->entries = newEntries;
-    table->capacity = capacity;
+// probing visits groups in triangular order, which covers every group when their number is a power of two
+typedef struct
+{
+    uint32_t mask;
+    uint32_t group;
+    uint32_t step;
+} Probe;
+
+static inline Probe startProbe(int capacity, uint32_t hash)
+{
+    Probe probe;
+    probe.mask = (uint32_t)(capacity / TABLE_GROUP_SIZE) - 1;
+    probe.group = HASH_GROUP(hash) & probe.mask;
+    probe.step = 0;
+    return probe;
+}
+
+static inline void nextProbe(Probe *probe)
+{
+    probe->step++;
+    probe->group = (probe->group + probe->step) & probe->mask;
 }
 
 // looks up existing entries in the hash table
-static Entry *findEntry(StringObject *key, Entry *entries, int capacity)
+// returns the slot index of the key, or -1 if it is not in the table
+static int findSlot(Table *table, StringObject *key)
 {
-    uint32_t index = key->hash % capacity;
-    Entry *tombstone = NULL;
-    for (;;)
+    int8_t fragment = HASH_FRAGMENT(key->hash);
+    for (Probe probe = startProbe(table->capacity, key->hash);; nextProbe(&probe))
     {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL)
-        {
-            // entry is empty
-            if (IS_NIL(entry->value))
-            {
-                // we find a truly empty entry, i.e. the key is not present
-                // if we have passed some tombstone earlier, return that bucket
-                // so tombstone bucket is reused for new values
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                // it is a tombstone
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-        }
-        else if (entry->key = key)
+        int base = probe.group * TABLE_GROUP_SIZE;
+        const int8_t *group = table->control + base;
+
+        for (uint32_t match = matchByte(group, fragment); match != 0; match &= match - 1)
         {
-            // Found the key
-            return entry;
+            int index = base + firstBit(match);
+            if (table->entries[index].key == key)
+                return index;
         }
 
-        // linear probing (check the next buckets sequentially)
-        index = (index + 1) % capacity;
+        // a key is never placed past a group that still has an empty slot
+        if (matchByte(group, CONTROL_EMPTY) != 0)
+            return -1;
+    }
+}
+
+// returns the first empty or deleted slot along the key's probe sequence
+static int findFreeSlot(int8_t *control, int capacity, uint32_t hash)
+{
+    for (Probe probe = startProbe(capacity, hash);; nextProbe(&probe))
+    {
+        int base = probe.group * TABLE_GROUP_SIZE;
+        uint32_t available = matchFree(control + base);
+        if (available != 0)
+            return base + firstBit(available);
     }
 }
 
+// allocate array of empty slots and move the live entries over, dropping all tombstones
+static void adjustCapacity(VM *vm, Table *table, int capacity)
+{
+    int8_t *control = ALLOCATE(vm, int8_t, capacity);
+    Entry *entries = ALLOCATE(vm, Entry, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
+
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->control[i] < 0)
+            continue;
+
+        Entry *entry = &table->entries[i];
+        int index = findFreeSlot(control, capacity, entry->key->hash);
+        control[index] = HASH_FRAGMENT(entry->key->hash);
+        entries[index] = *entry;
+    }
+
+    // release memory for old arrays
+    FREE_ARRAY(vm, int8_t, table->control, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+
+    table->control = control;
+    table->entries = entries;
+    table->capacity = capacity;
+    table->tombstones = 0;
+}
+
 void initTable(Table *table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
-void freeTable(Table *table)
+void freeTable(VM *vm, Table *table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, int8_t, table->control, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     initTable(table);
 }
 
-void tableAdd(Table *table, StringObject *key, Value value)
+bool tableAdd(VM *vm, Table *table, StringObject *key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    if (table->capacity > 0)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        int index = findSlot(table, key);
+        if (index != -1)
+        {
+            table->entries[index].value = value;
+            return false;
+        }
     }
 
-    Entry *entry = findEntry(key, table->entries, table->capacity);
-    bool isNewKey = entry->key == NULL;
+    if (table->count + table->tombstones + 1 > TABLE_MAX_LOAD(table->capacity))
+    {
+        // if most of the load is tombstones, cleaning them up in place is enough
+        int capacity = table->capacity;
+        if (table->count + 1 > TABLE_MAX_LOAD(capacity) / 2)
+            capacity = capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : capacity * 2;
+        adjustCapacity(vm, table, capacity);
+    }
 
-    // increment count only if new entry goes into entirely empty bucket
-    // and not while reusing a tombstone
-    if (isNewKey && IS_NIL(entry->value))
-        table->count++;
+    int index = findFreeSlot(table->control, table->capacity, key->hash);
+    if (table->control[index] == CONTROL_DELETED)
+        table->tombstones--;
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    table->control[index] = HASH_FRAGMENT(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+    return true;
 }
 
-void tableAddAll(Table *from, Table *to)
+void tableAddAll(VM *vm, Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
-        Entry *entry = &from->entries[i];
-        if (entry->key != NULL)
+        if (from->control[i] >= 0)
         {
-            tableAdd(to, entry->key, entry->value);
+            Entry *entry = &from->entries[i];
+            tableAdd(vm, to, entry->key, entry->value);
         }
     }
 }
 
-bool tableDelete(Table *table, StringObject *key)
+static void removeSlot(Table *table, int index)
+{
+    // a slot can go straight back to empty if its group already has an empty slot:
+    // no lookup has ever probed past such a group, so nothing depends on this slot being occupied.
+    // otherwise place a tombstone so probing continues past it
+    const int8_t *group = table->control + (index & ~(TABLE_GROUP_SIZE - 1));
+    if (matchByte(group, CONTROL_EMPTY) != 0)
+    {
+        table->control[index] = CONTROL_EMPTY;
+    }
+    else
+    {
+        table->control[index] = CONTROL_DELETED;
+        table->tombstones++;
+    }
+
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
+}
+
+// halves the capacity while the table is less than 1/8 full.
+// growing only happens at 7/8, so a table doesn't flip between the two sizes.
+static void shrinkToFit(VM *vm, Table *table)
+{
+    int capacity = table->capacity;
+    while (capacity > TABLE_GROUP_SIZE && table->count < capacity / TABLE_SHRINK_RATIO)
+        capacity /= 2;
+
+    if (table->count == 0)
+        freeTable(vm, table);
+    else if (capacity != table->capacity)
+        adjustCapacity(vm, table, capacity);
+}
+
+bool tableDelete(VM *vm, Table *table, StringObject *key)
 {
     if (table->count == 0)
         return false;
 
     // Find the entry
-    Entry *entry = findEntry(key, table->entries, table->capacity);
-    if (entry->key == NULL)
-        return;
+    int index = findSlot(table, key);
+    if (index == -1)
+        return false;
 
-    // Delete the entry and place a tombstone (key = NULL and value = True)
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    removeSlot(table, index);
+    shrinkToFit(vm, table);
     return true;
 }
 
+void tableRemoveUnmarked(VM *vm, Table *table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->control[i] >= 0 && !isMarked(vm, (Object *)table->entries[i].key))
+            removeSlot(table, i);
+    }
+    shrinkToFit(vm, table);
+}
+
+void tableRemoveRegionKeys(VM *vm, Table *table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->control[i] >= 0 && table->entries[i].key->object.isRegion)
+            removeSlot(table, i);
+    }
+    shrinkToFit(vm, table);
+}
+
+void tableGetStats(Table *table, TableStats *stats)
+{
+    stats->count = table->count;
+    stats->tombstones = table->tombstones;
+    stats->capacity = table->capacity;
+    stats->bytes = (size_t)table->capacity * (sizeof(int8_t) + sizeof(Entry));
+}
+
 bool tableGet(Table *table, StringObject *key, Value *value)
 {
     if (table->count == 0)
         return false;
 
-    Entry *entry = findEntry(key, table->entries, table->capacity);
-    if (entry->key == NULL)
+    int index = findSlot(table, key);
+    if (index == -1)
         return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
-}
\ No newline at end of file
+}
+
+StringObject *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
+{
+    if (table->count == 0)
+        return NULL;
+
+    int8_t fragment = HASH_FRAGMENT(hash);
+    for (Probe probe = startProbe(table->capacity, hash);; nextProbe(&probe))
+    {
+        int base = probe.group * TABLE_GROUP_SIZE;
+        const int8_t *group = table->control + base;
+
+        for (uint32_t match = matchByte(group, fragment); match != 0; match &= match - 1)
+        {
+            StringObject *key = table->entries[base + firstBit(match)].key;
+            if (key->length == length &&
+                key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0)
+            {
+                // we find the string
+                return key;
+            }
+        }
+
+        // stop at the first group with an empty slot
+        if (matchByte(group, CONTROL_EMPTY) != 0)
+            return NULL;
+    }
+}
@@ -4,64 +4,72 @@
 #include "common.h"
 #include "value.h"
 
+// slots are probed a group at a time. With SSE2 a whole group is checked with one compare.
+#define TABLE_GROUP_SIZE 16
+
+// control byte values. A full slot stores the low 7 bits of its key's hash instead, which is never negative.
+#define CONTROL_EMPTY ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+
 typedef struct
 {
     StringObject *key;
     Value value;
 } Entry;
 
+/*
+open addressing hash table with the metadata kept apart from the entries.
+every slot has a control byte telling whether it is empty, deleted (a tombstone) or full,
+and for full slots a fragment of the hash. Lookups scan the control bytes of a group
+and only touch the entries whose hash fragment matches.
+*/
 typedef struct
 {
-    int count;
-    int capacity;
+    int count;      // number of live entries
+    int tombstones; // number of deleted slots, they still take part in the load factor
+    int capacity;   // 0 or a power of two that is a multiple of TABLE_GROUP_SIZE
+    int8_t *control;
     Entry *entries;
 } Table;
 
+// size statistics of a table, e.g. to watch the intern table in long running processes
+typedef struct
+{
+    int count;
+    int tombstones;
+    int capacity;
+    size_t bytes; // memory taken by the control bytes and entries
+} TableStats;
+
 void initTable(Table *table);
-void freeTable(Table *table);
+void freeTable(VM *vm, Table *table);
 
 // adds an entry to the hash table.
 // if an entry is already present for the key, it is overwritten by the new value
 // returns true if the entry was added
-bool tableAdd(Table *table, StringObject *key, Value value);
+bool tableAdd(VM *vm, Table *table, StringObject *key, Value value);
 
 // add all entries of one hash table to another
-void tableAddAll(Table *from, Table *to);
+void tableAddAll(VM *vm, Table *from, Table *to);
 
-// deletes an entry from the hash table
-bool tableDelete(Table *table, StringObject *key);
+// deletes an entry from the hash table. The table shrinks once it gets sparse enough.
+bool tableDelete(VM *vm, Table *table, StringObject *key);
 
-//
-StringObject *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
-{
-    if (table->count == 0)
-        return NULL;
-
-    uint32_t index = hash % table->capacity;
-    for (;;)
-    {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL)
-        {
-            // stop if we find an empty non-tombstone bucket
-            if (IS_NIL(entry->value))
-                return NULL;
-        }
-        else if (entry->key->length == length &&
-                 entry->key->hash == hash &&
-                 memcmp(entry->key->chars, chars, length) == 0)
-        {
-            // we find the string
-            return entry->key;
-        }
-
-        index = (index + 1) % table->capacity;
-    }
-}
+// deletes every entry whose key wasn't marked by the garbage collector.
+// this makes the intern table weak: it never keeps a string alive by itself.
+void tableRemoveUnmarked(VM *vm, Table *table);
+
+// deletes every entry whose key was allocated inside the active region
+void tableRemoveRegionKeys(VM *vm, Table *table);
+
+void tableGetStats(Table *table, TableStats *stats);
+
+// looks up a string by its characters instead of by identity. Used for interning.
+StringObject *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
 
 // retrieves a value from the hash table
 // returns true if an entry with the given key is found. Returns false otherwise
 // if entry exists, the value argument that was passed will point to the resulting value
 bool tableGet(Table *table, StringObject *key, Value *value);
 
-#endif
\ No newline at end of file
+#endif
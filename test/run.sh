@@ -0,0 +1,25 @@
+#!/bin/sh
+# usage: test/run.sh <clox>
+# runs every test/*.lox with the given clox and compares what it prints with the test's "// expect: " comments.
+# a line starting with "// args: " runs the test with those arguments instead of just its path. $test stands for the path
+clox=$1
+if [ -z "$clox" ]; then
+    echo "Usage: test/run.sh <clox>" >&2
+    exit 64
+fi
+
+failed=0
+for test in "$(dirname "$0")"/*.lox; do
+    args=$(sed -n 's|^// args: ||p' "$test")
+    [ -z "$args" ] && args='$test'
+    expected=$(sed -n 's|.*// expect: ||p' "$test")
+    actual=$(eval "\"\$clox\" $args" 2>&1)
+    if [ "$actual" != "$expected" ]; then
+        echo "FAIL $test"
+        echo "$actual" | head -5
+        failed=1
+    fi
+done
+
+[ $failed = 0 ] && echo "tests ok"
+exit $failed
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -5,7 +6,7 @@
 #include "object.h"
 #include "value.h"
 
-bool valuesEqual(Value a, Value b)
+bool valuesEqual(VM *vm, Value a, Value b)
 {
     if (a.type != b.type)
         return false;
@@ -18,15 +19,20 @@ bool valuesEqual(Value a, Value b)
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJECT:
+    {
+        // only strings from the source code are interned, others have to be compared by their characters
+        if (IS_ANY_STRING(a) && IS_ANY_STRING(b))
+            return stringsEqual(vm, AS_OBJECT(a), AS_OBJECT(b));
         return AS_OBJECT(a) == AS_OBJECT(b);
+    }
     default:
         return false;
     }
 }
 
-void freeValueArray(ValueArray *array)
+void freeValueArray(VM *vm, ValueArray *array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
@@ -37,20 +43,49 @@ void initValueArray(ValueArray *array)
     array->count = 0;
 }
 
-void writeValueArray(ValueArray *array, Value value)
+void writeValueArray(VM *vm, ValueArray *array, Value value)
 {
     if (array->capacity < array->count + 1)
     {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
     }
 
     array->values[array->count] = value;
     array->count++;
 }
 
-void printValue(Value value)
+int formatNumber(double number, char *buffer)
+{
+    // "%g" prints integers below a million digit by digit, so those can skip printf.
+    // -0 is left to printf to keep its sign
+    if (number > -1000000 && number < 1000000 && number == (int)number && !(number == 0 && signbit(number)))
+    {
+        int integer = (int)number;
+        unsigned int digits = integer < 0 ? -integer : integer;
+
+        char reversed[8];
+        int count = 0;
+        do
+        {
+            reversed[count++] = (char)('0' + digits % 10);
+            digits /= 10;
+        } while (digits > 0);
+
+        int length = 0;
+        if (integer < 0)
+            buffer[length++] = '-';
+        while (count > 0)
+            buffer[length++] = reversed[--count];
+        buffer[length] = '\0';
+        return length;
+    }
+
+    return snprintf(buffer, NUMBER_FORMAT_SIZE, "%g", number);
+}
+
+void printValue(VM *vm, Value value)
 {
     switch (value.type)
     {
@@ -61,10 +96,14 @@ void printValue(Value value)
         printf("nil");
         break;
     case VAL_NUMBER:
-        printf("%g", AS_NUMBER(value));
+    {
+        char number[NUMBER_FORMAT_SIZE];
+        formatNumber(AS_NUMBER(value), number);
+        printf("%s", number);
         break;
+    }
     case VAL_OBJECT:
-        printObject(value);
+        printObject(vm, value);
         break;
     }
 }
@@ -5,6 +5,7 @@
 
 typedef struct Object Object;
 typedef struct StringObject StringObject;
+typedef struct VM VM;
 
 typedef enum
 {
@@ -50,12 +51,18 @@ typedef struct
     Value *values;
 } ValueArray;
 
-bool valuesEqual(Value a, Value b);
+bool valuesEqual(VM *vm, Value a, Value b);
 
-void freeValueArray(ValueArray *array);
+void freeValueArray(VM *vm, ValueArray *array);
 void initValueArray(ValueArray *array);
-void writeValueArray(ValueArray *array, Value value);
+void writeValueArray(VM *vm, ValueArray *array, Value value);
 
-void printValue(Value value);
+// big enough for any number formatted by formatNumber()
+#define NUMBER_FORMAT_SIZE 32
+
+// formats a number like printf's "%g" and returns the number of characters written
+int formatNumber(double number, char *buffer);
+
+void printValue(VM *vm, Value value);
 
 #endif
@@ -2,37 +2,284 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "files.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
 
-VM vm;
-
-static Value clockNative(int argCount, Value *args)
+static Value clockNative(VM *vm, int argCount, Value *args)
 {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void resetVMStack()
+// length(string) returns the number of characters in the string
+static Value lengthNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_ANY_STRING(args[0]))
+        return NIL_VAL;
+
+    int length;
+    stringChars(vm, AS_OBJECT(args[0]), &length);
+    return NUMBER_VAL(length);
+}
+
+// turns a number argument into an index between 0 and length. Converting NaN or an out of range double to int is undefined,
+// so it is clamped while it is still a double
+static int clampIndex(double index, int length)
+{
+    if (!(index > 0))
+        return 0;
+    if (index > length)
+        return length;
+    return (int)index;
+}
+
+// substring(string, start, end) returns the characters from start up to, but not including, end.
+// long substrings are slices sharing the characters of the original string instead of copies
+static Value substringNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 3 || !IS_ANY_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2]))
+        return NIL_VAL;
+
+    Object *string = AS_OBJECT(args[0]);
+    int length;
+    const char *chars = stringChars(vm, string, &length);
+
+    int start = clampIndex(AS_NUMBER(args[1]), length);
+    int end = clampIndex(AS_NUMBER(args[2]), length);
+    if (end < start)
+        end = start;
+
+    if (end - start < SLICE_MIN_LENGTH)
+        return OBJECT_VAL(copyString(vm, chars + start, end - start));
+
+    // a slice of a slice points straight at the original characters
+    Object *owner = string;
+    if (string->type == OBJECT_SLICE)
+        owner = ((SliceObject *)string)->owner;
+    else if (string->type == OBJECT_ROPE)
+        owner = (Object *)flattenString(vm, string);
+    return OBJECT_VAL(newSlice(vm, owner, chars + start, end - start));
+}
+
+// indexOf(string, search, from) returns where search first occurs in string at or after from, or -1
+static Value indexOfNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 3 || !IS_ANY_STRING(args[0]) || !IS_ANY_STRING(args[1]) || !IS_NUMBER(args[2]))
+        return NIL_VAL;
+
+    int length, searchLength;
+    const char *chars = stringChars(vm, AS_OBJECT(args[0]), &length);
+    const char *search = stringChars(vm, AS_OBJECT(args[1]), &searchLength);
+
+    if (AS_NUMBER(args[2]) > length)
+        return NUMBER_VAL(-1);
+    int from = clampIndex(AS_NUMBER(args[2]), length);
+
+    // jump between occurrences of the first character with memchr and only compare there
+    const char *end = chars + length - searchLength;
+    for (const char *current = chars + from; current <= end; current++)
+    {
+        if (searchLength == 0)
+            return NUMBER_VAL((double)(current - chars));
+
+        current = memchr(current, search[0], end - current + 1);
+        if (current == NULL)
+            break;
+        if (memcmp(current, search, searchLength) == 0)
+            return NUMBER_VAL((double)(current - chars));
+    }
+    return NUMBER_VAL(-1);
+}
+
+// coroutine(function) wraps the function in a coroutine. Calling the coroutine starts or resumes it
+static Value coroutineNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_FUNCTION(args[0]))
+        return NIL_VAL;
+    return OBJECT_VAL(newCoroutine(vm, AS_FUNCTION(args[0])));
+}
+
+// pushes the function and its arguments onto the coroutine's own stack, ready to be called when it first runs
+static void prepareCoroutine(VM *vm, CoroutineObject *coroutine, int argCount, Value *args)
+{
+    // call() makes room for the function's temporaries once it starts. A function that has been
+    // compiled already gets all of it right away, so the stack doesn't have to be copied then
+    coroutine->frameCapacity = FRAMES_MIN;
+    coroutine->frames = ALLOCATE(vm, CallFrame, coroutine->frameCapacity);
+    coroutine->stackCapacity = UINT8_COUNT;
+    while (coroutine->stackCapacity < coroutine->function->maxSlots)
+        coroutine->stackCapacity *= 2;
+    coroutine->stack = ALLOCATE(vm, Value, coroutine->stackCapacity);
+    coroutine->stackTop = coroutine->stack;
+
+    *coroutine->stackTop++ = OBJECT_VAL(coroutine->function);
+    for (int i = 0; i < argCount; i++)
+        *coroutine->stackTop++ = args[i];
+}
+
+// spawn(function, arguments...) runs the function as a task. Tasks start once the scripts are done
+// and take turns whenever one of them waits for I/O or a timer
+static Value spawnNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount < 1 || argCount > UINT8_MAX || !IS_FUNCTION(args[0]))
+        return NIL_VAL;
+
+    CoroutineObject *task = newCoroutine(vm, AS_FUNCTION(args[0]));
+    task->isTask = true;
+    prepareCoroutine(vm, task, argCount - 1, args + 1);
+    addTask(vm, task);
+    return OBJECT_VAL(task);
+}
+
+// isDone(coroutine) tells whether the coroutine's function has returned
+static Value isDoneNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_COROUTINE(args[0]))
+        return NIL_VAL;
+    return BOOL_VAL(AS_COROUTINE(args[0])->state == COROUTINE_DONE);
+}
+
+// stores the current stacks back into whoever they belong to
+static void saveStacks(VM *vm)
+{
+    CoroutineObject *coroutine = vm->coroutine;
+    if (coroutine == NULL)
+    {
+        vm->mainFrames = vm->frames;
+        vm->mainFrameCount = vm->frameCount;
+        vm->mainFrameCapacity = vm->frameCapacity;
+        vm->mainStack = vm->stack;
+        vm->mainStackTop = vm->stackTop;
+        vm->mainStackCapacity = vm->stackCapacity;
+        return;
+    }
+
+    coroutine->frames = vm->frames;
+    coroutine->frameCount = vm->frameCount;
+    coroutine->frameCapacity = vm->frameCapacity;
+    coroutine->stack = vm->stack;
+    coroutine->stackTop = vm->stackTop;
+    coroutine->stackCapacity = vm->stackCapacity;
+}
+
+// makes the VM continue on the stacks of the given coroutine, or of the main program for NULL
+static void switchStacks(VM *vm, CoroutineObject *coroutine)
+{
+    saveStacks(vm);
+    vm->coroutine = coroutine;
+
+    if (coroutine == NULL)
+    {
+        vm->frames = vm->mainFrames;
+        vm->frameCount = vm->mainFrameCount;
+        vm->frameCapacity = vm->mainFrameCapacity;
+        vm->stack = vm->mainStack;
+        vm->stackTop = vm->mainStackTop;
+        vm->stackCapacity = vm->mainStackCapacity;
+        return;
+    }
+
+    coroutine->state = COROUTINE_RUNNING;
+    vm->frames = coroutine->frames;
+    vm->frameCount = coroutine->frameCount;
+    vm->frameCapacity = coroutine->frameCapacity;
+    vm->stack = coroutine->stack;
+    vm->stackTop = coroutine->stackTop;
+    vm->stackCapacity = coroutine->stackCapacity;
+}
+
+// a finished coroutine doesn't need its stacks anymore, even if the coroutine object lives on
+static void freeCoroutineStacks(VM *vm, CoroutineObject *coroutine)
+{
+    FREE_ARRAY(vm, CallFrame, coroutine->frames, coroutine->frameCapacity);
+    FREE_ARRAY(vm, Value, coroutine->stack, coroutine->stackCapacity);
+    coroutine->frames = NULL;
+    coroutine->frameCount = 0;
+    coroutine->frameCapacity = 0;
+    coroutine->stack = NULL;
+    coroutine->stackTop = NULL;
+    coroutine->stackCapacity = 0;
+}
+
+static void resetVMStack(VM *vm)
+{
+    // coroutines interrupted by an error can't be resumed anymore
+    saveStacks(vm);
+    for (CoroutineObject *coroutine = vm->coroutine; coroutine != NULL; coroutine = coroutine->resumer)
+    {
+        coroutine->state = COROUTINE_DONE;
+        freeCoroutineStacks(vm, coroutine);
+    }
+
+    vm->coroutine = NULL;
+    vm->coroutineDepth = 0;
+    vm->frames = vm->mainFrames;
+    vm->frameCount = 0;
+    vm->frameCapacity = vm->mainFrameCapacity;
+    vm->stack = vm->mainStack;
+    vm->stackTop = vm->stack; // initially points to beginning of the array
+    vm->stackCapacity = vm->mainStackCapacity;
+}
+
+// makes sure the value stack has room for count more values. Frames hold pointers into the stack, so they move along with it
+static bool reserveSlots(VM *vm, int count)
 {
-    vm.stackTop = vm.stack; // initially points to beginning of the array
-    vm.frameCount = 0;
+    int needed = (int)(vm->stackTop - vm->stack) + count;
+    if (needed <= vm->stackCapacity)
+        return true;
+    if (needed > vm->frameLimit * UINT8_COUNT)
+        return false;
+
+    int capacity = vm->stackCapacity;
+    while (capacity < needed)
+        capacity *= 2;
+
+    Value *stack = ALLOCATE(vm, Value, capacity);
+    memcpy(stack, vm->stack, sizeof(Value) * vm->stackCapacity);
+    for (int i = 0; i < vm->frameCount; i++)
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    vm->stackTop = stack + (vm->stackTop - vm->stack);
+
+    FREE_ARRAY(vm, Value, vm->stack, vm->stackCapacity);
+    vm->stack = stack;
+    vm->stackCapacity = capacity;
+    return true;
 }
 
-static void runtimeError(const char *format, ...)
+// makes room for one more call frame, unless the call chain is as deep as it may get
+static bool reserveFrame(VM *vm)
 {
+    if (vm->frameCount >= vm->frameLimit)
+        return false;
+    if (vm->frameCount < vm->frameCapacity)
+        return true;
+
+    int oldCapacity = vm->frameCapacity;
+    vm->frameCapacity = GROW_CAPACITY(oldCapacity) < vm->frameLimit ? GROW_CAPACITY(oldCapacity) : vm->frameLimit;
+    vm->frames = GROW_ARRAY(vm, CallFrame, vm->frames, oldCapacity, vm->frameCapacity);
+    return true;
+}
+
+static void runtimeError(VM *vm, const char *format, ...)
+{
+    // whatever the script printed so far should show up before the error
+    flushOutput(&vm->output);
+
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    for (int i = vm.frameCount - 1; i >= 0; i++)
+    for (int i = vm->frameCount - 1; i >= 0; i--)
     {
-        CallFrame *frame = &vm.frames[i];
+        CallFrame *frame = &vm->frames[i];
         FunctionObject *function = frame->function;
 
         // -1 because the IP is already sitting on the next instruction
@@ -50,111 +297,464 @@ static void runtimeError(const char *format, ...)
         }
     }
 
-    resetVMStack();
+    resetVMStack(vm);
 }
 
-static void defineNative(const char *name, NativeFunction function)
+void defineNative(VM *vm, const char *name, NativeFunction function)
 {
-    pushToStack(OBJECT_VAL(copyString(name, (int)strlen(name))));
-    pushToStack(OBJECT_VAL(newNative(function)));
-    tableAdd(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    popFromStack();
-    popFromStack();
+    pushToStack(vm, OBJECT_VAL(copyString(vm, name, (int)strlen(name))));
+    pushToStack(vm, OBJECT_VAL(newNative(vm, function, AS_STRING(vm->stack[0]))));
+    tableAdd(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+    popFromStack(vm);
+    popFromStack(vm);
 }
 
-void initVM()
+// sets up everything a program can change: the stacks, the objects, the globals and the strings
+static void initProgramState(VM *vm)
 {
-    resetVMStack();
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    vm->objects = NULL;
+    vm->region.isActive = false;
+    vm->region.mark = NULL;
+    initArena(&vm->region.arena);
+    vm->segments = NULL;
 
-    defineNative("clock", clockNative);
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->frozenObjects = NULL;
+    vm->marks.objects = NULL;
+    vm->marks.count = 0;
+    vm->marks.capacity = 0;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
 
-    vm.objects = NULL;
+    // the stacks start small, so an idle VM costs little
+    vm->coroutine = NULL;
+    vm->frameCapacity = FRAMES_MIN;
+    vm->frames = ALLOCATE(vm, CallFrame, vm->frameCapacity);
+    vm->stackCapacity = UINT8_COUNT;
+    vm->stack = ALLOCATE(vm, Value, vm->stackCapacity);
+    vm->stackTop = vm->stack;
+    resetVMStack(vm);
+
+    initTable(&vm->globals);
+    initTable(&vm->strings);
+    initValueArray(&vm->pinned);
+    vm->pinnedFree = -1;
+    vm->hostArgs = NULL;
+    vm->hostArgCount = 0;
+    vm->hostResults = NULL;
+    vm->hostResultCount = 0;
+    initEventLoop(&vm->loop);
+
+    defineNative(vm, "clock", clockNative);
+    defineNative(vm, "length", lengthNative);
+    defineNative(vm, "substring", substringNative);
+    defineNative(vm, "indexOf", indexOfNative);
+    defineNative(vm, "coroutine", coroutineNative);
+    defineNative(vm, "isDone", isDoneNative);
+    defineNative(vm, "spawn", spawnNative);
+    defineEventLoopNatives(vm);
+    defineFileNatives(vm);
 }
 
-InterpretResult interpretCode(const char *sourceCode)
+static void freeProgramState(VM *vm)
 {
-    FunctionObject *function = compileCode(sourceCode);
-    if (function == NULL)
+    freeEventLoop(vm);
+    resetVMStack(vm);
+    FREE_ARRAY(vm, CallFrame, vm->frames, vm->frameCapacity);
+    FREE_ARRAY(vm, Value, vm->stack, vm->stackCapacity);
+    freeTable(vm, &vm->globals);
+    freeTable(vm, &vm->strings);
+    freeValueArray(vm, &vm->pinned);
+    freeObjects(vm);
+    freeArena(&vm->region.arena);
+    freeCodeSegments(vm);
+}
+
+void initVM(VM *vm)
+{
+    vm->frameLimit = FRAMES_MAX;
+    memset(&vm->pools, 0, sizeof(vm->pools));
+    pthread_mutex_init(&vm->heapLock, NULL);
+
+    // interactive output is flushed line by line, everything else in big chunks
+#ifdef DEBUG_TRACE_EXECUTION
+    initOutput(&vm->output, STDOUT_FILENO, FLUSH_LINE);
+#else
+    initOutput(&vm->output, STDOUT_FILENO, isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_EXIT);
+#endif
+
+    initProgramState(vm);
+}
+
+void resetVM(VM *vm)
+{
+    releaseOutput(&vm->output);
+    freeProgramState(vm);
+    initProgramState(vm);
+}
+
+InterpretResult interpretCode(VM *vm, const char *sourceCode)
+{
+    return interpretSources(vm, &sourceCode, 1);
+}
+
+InterpretResult interpretSources(VM *vm, const char **sources, int count)
+{
+    if (!reserveSlots(vm, count))
     {
+        fprintf(stderr, "Too many sources.\n");
         return INTERPRET_COMPILE_ERROR;
     }
 
-    // store top-level function on stack and prepare initial CallFrame to execute it
-    pushToStack(OBJECT_VAL(function));
-    call(function, 0);
+    FunctionObject **functions = ALLOCATE(vm, FunctionObject *, count);
+    if (!compileSources(vm, sources, count, functions))
+    {
+        FREE_ARRAY(vm, FunctionObject *, functions, count);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    // store the top-level functions on the stack, so they stay reachable until they run.
+    // the first one to run goes on top
+    for (int i = count - 1; i >= 0; i--)
+    {
+#ifdef LINK_CODE_SEGMENTS
+        linkProgram(vm, functions[i]);
+#endif
+        pushToStack(vm, OBJECT_VAL(functions[i]));
+    }
+
+    // run them one after the other. Each one leaves its return value in its place on the stack
+    InterpretResult result = INTERPRET_OK;
+    for (int i = 0; i < count && result == INTERPRET_OK; i++)
+    {
+        call(vm, functions[i], 0);
+        result = run(vm);
+        if (result == INTERPRET_OK)
+            popFromStack(vm);
+    }
 
-    return run();
+    // then the tasks they spawned
+    if (result == INTERPRET_OK && !runEventLoop(vm))
+        result = INTERPRET_RUNTIME_ERROR;
+    else if (result != INTERPRET_OK)
+        resetEventLoop(vm);
+
+    FREE_ARRAY(vm, FunctionObject *, functions, count);
+    flushOutput(&vm->output);
+    return result;
+}
+
+// the global function with the given name, or NULL
+static FunctionObject *findGlobalFunction(VM *vm, const char *name)
+{
+    Value callee;
+    StringObject *key = copyString(vm, name, (int)strlen(name));
+    if (!tableGet(&vm->globals, key, &callee) || !IS_FUNCTION(callee))
+        return NULL;
+    return AS_FUNCTION(callee);
 }
 
-void freeVM()
+// runs one call of the function. Its result is left on the stack
+static InterpretResult invoke(VM *vm, FunctionObject *function, int argCount, Value *args)
 {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    freeObjects();
+    if (argCount >= UINT8_COUNT || !reserveSlots(vm, argCount + 1))
+    {
+        fprintf(stderr, "Too many arguments for '%s'.\n", function->name->chars);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    pushToStack(vm, OBJECT_VAL(function));
+    for (int i = 0; i < argCount; i++)
+        pushToStack(vm, args[i]);
+
+    // call() reports a wrong number of arguments itself
+    if (!call(vm, function, argCount))
+        return INTERPRET_RUNTIME_ERROR;
+    return run(vm);
 }
 
-void pushToStack(Value value)
+// runs the tasks the host's call spawned, or drops them if the call failed, then shows what it printed
+static InterpretResult finishHostCall(VM *vm, InterpretResult status)
 {
-    *vm.stackTop = value;
-    vm.stackTop++;
+    if (status == INTERPRET_OK && !runEventLoop(vm))
+        status = INTERPRET_RUNTIME_ERROR;
+    else if (status != INTERPRET_OK)
+        resetEventLoop(vm);
+
+    vm->hostArgs = NULL;
+    vm->hostArgCount = 0;
+    vm->hostResults = NULL;
+    vm->hostResultCount = 0;
+
+    flushOutput(&vm->output);
+    return status;
 }
 
-Value popFromStack()
+static InterpretResult callHost(VM *vm, FunctionObject *function, int argCount, Value *args, Value *result)
 {
-    vm.stackTop--;
-    return *vm.stackTop;
+    // the arguments may be objects nothing else refers to until they are on the stack
+    vm->hostArgs = args;
+    vm->hostArgCount = argCount;
+
+    InterpretResult status = invoke(vm, function, argCount, args);
+    if (status == INTERPRET_OK)
+        *result = popFromStack(vm);
+    return finishHostCall(vm, status);
 }
 
-static Value peek(int distance)
+InterpretResult callFunction(VM *vm, const char *name, int argCount, Value *args, Value *result)
 {
-    return vm.stackTop[-(distance + 1)];
+    FunctionObject *function = findGlobalFunction(vm, name);
+    if (function == NULL)
+    {
+        fprintf(stderr, "Undefined function '%s'.\n", name);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return callHost(vm, function, argCount, args, result);
 }
 
-static bool call(FunctionObject *function, int argCount)
+int pinValue(VM *vm, Value value)
 {
+    // a slot's value says nothing about whether it is taken: nil can be pinned and endRegion() nils slots it keeps
+    if (vm->pinnedFree >= 0)
+    {
+        int index = vm->pinnedFree;
+        vm->pinnedFree = (int)AS_NUMBER(vm->pinned.values[index]);
+        vm->pinned.values[index] = value;
+        return index;
+    }
+
+    writeValueArray(vm, &vm->pinned, value);
+    return vm->pinned.count - 1;
+}
+
+void unpinValue(VM *vm, int index)
+{
+    vm->pinned.values[index] = NUMBER_VAL(vm->pinnedFree);
+    vm->pinnedFree = index;
+}
+
+bool findFunction(VM *vm, const char *name, FunctionHandle *handle)
+{
+    handle->function = findGlobalFunction(vm, name);
+    if (handle->function == NULL)
+        return false;
+    handle->pin = pinValue(vm, OBJECT_VAL(handle->function));
+    return true;
+}
+
+void releaseFunction(VM *vm, FunctionHandle *handle)
+{
+    unpinValue(vm, handle->pin);
+    handle->function = NULL;
+}
+
+InterpretResult callHandle(VM *vm, FunctionHandle *handle, int argCount, Value *args, Value *result)
+{
+    return callHost(vm, handle->function, argCount, args, result);
+}
+
+InterpretResult callBatch(VM *vm, FunctionHandle *handle, int callCount, int argCount, Value *args, Value *results,
+                          int *callsDone)
+{
+    vm->hostArgs = args;
+    vm->hostArgCount = callCount * argCount;
+    vm->hostResults = results;
+    vm->hostResultCount = 0;
+
+    InterpretResult status = INTERPRET_OK;
+    for (int i = 0; i < callCount && status == INTERPRET_OK; i++)
+    {
+        status = invoke(vm, handle->function, argCount, args + i * argCount);
+        if (status == INTERPRET_OK)
+            results[vm->hostResultCount++] = popFromStack(vm);
+    }
+
+    if (callsDone != NULL)
+        *callsDone = vm->hostResultCount;
+    return finishHostCall(vm, status);
+}
+
+void freeVM(VM *vm)
+{
+    releaseOutput(&vm->output);
+    freeProgramState(vm);
+    freeMemoryPools(vm);
+    pthread_mutex_destroy(&vm->heapLock);
+}
+
+void pushToStack(VM *vm, Value value)
+{
+    *vm->stackTop = value;
+    vm->stackTop++;
+}
+
+Value popFromStack(VM *vm)
+{
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+static Value peek(VM *vm, int distance)
+{
+    return vm->stackTop[-(distance + 1)];
+}
+
+static bool call(VM *vm, FunctionObject *function, int argCount)
+{
+#ifdef LAZY_COMPILE
+    // the arity is only known once the body has been compiled
+    if (function->source != NULL && !compileFunction(vm, function))
+    {
+        runtimeError(vm, "Could not compile function '%s'.", function->name->chars);
+        return false;
+    }
+#endif
+
     // runtime error if user passes too many or too few arguments
     if (argCount != function->arity)
     {
-        runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
         return false;
     }
 
-    // runtime error if deep call chain exceeds stack
-    if (vm.frameCount == FRAMES_MAX)
+    // runtime error if deep call chain exceeds stack.
+    // the new frame's slots start at the callee, which is on the stack with its arguments already
+    if (!reserveFrame(vm) || !reserveSlots(vm, function->maxSlots - argCount - 1))
     {
-        runtimeError("Stack overflow.");
+        runtimeError(vm, "Stack overflow.");
         return false;
     }
 
-    CallFrame *frame = &vm.frames[vm.frameCount++];
+    CallFrame *frame = &vm->frames[vm->frameCount++];
     frame->function = function;
     frame->instructionPointer = function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
     return true;
 }
 
-static bool callValue(Value callee, int argCount)
+// starts the coroutine with the arguments on the stack, or continues it from where it yielded.
+// the coroutine's next yield or return value ends up on the resumer's stack in place of the call
+static bool resume(VM *vm, CoroutineObject *coroutine, int argCount)
+{
+    if (coroutine->state == COROUTINE_DONE)
+    {
+        runtimeError(vm, "Cannot resume a finished coroutine.");
+        return false;
+    }
+    if (coroutine->state != COROUTINE_SUSPENDED)
+    {
+        runtimeError(vm, "Cannot resume a running coroutine.");
+        return false;
+    }
+
+    if (vm->coroutineDepth == COROUTINES_MAX)
+    {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+
+    if (coroutine->isTask)
+    {
+        runtimeError(vm, "Cannot resume a task.");
+        return false;
+    }
+
+    // its stack would end up holding objects that are freed with the region
+    if (vm->region.isActive && !coroutine->object.isRegion)
+    {
+        runtimeError(vm, "Cannot resume a coroutine created outside the region.");
+        return false;
+    }
+
+    bool isStarted = coroutine->stack != NULL;
+    if (isStarted && argCount > 1)
+    {
+        runtimeError(vm, "Can only pass one value to a suspended coroutine.");
+        return false;
+    }
+
+    Value *args = vm->stackTop - argCount;
+    if (!isStarted)
+        prepareCoroutine(vm, coroutine, argCount, args);
+
+    // the callee and its arguments leave the resumer's stack
+    Value value = argCount == 1 ? args[0] : NIL_VAL;
+    vm->stackTop -= argCount + 1;
+
+    if (vm->coroutine != NULL)
+        vm->coroutine->state = COROUTINE_NORMAL;
+    coroutine->resumer = vm->coroutine;
+    switchStacks(vm, coroutine);
+    vm->coroutineDepth++;
+
+    if (!isStarted)
+        return call(vm, coroutine->function, argCount);
+    pushToStack(vm, value);
+    return true;
+}
+
+// stops the running coroutine where it is and hands value to its resumer
+static void suspendCoroutine(VM *vm, Value value)
+{
+    CoroutineObject *coroutine = vm->coroutine;
+    coroutine->state = COROUTINE_SUSPENDED;
+    switchStacks(vm, coroutine->resumer);
+    vm->coroutineDepth--;
+    pushToStack(vm, value);
+}
+
+InterpretResult resumeTask(VM *vm, CoroutineObject *task, Value value)
+{
+    // the event loop only runs once the main program has nothing left on its stacks
+    task->resumer = NULL;
+    switchStacks(vm, task);
+    vm->coroutineDepth++;
+
+    if (task->frameCount > 0)
+        pushToStack(vm, value);
+    else if (!call(vm, task->function, (int)(vm->stackTop - vm->stack) - 1))
+        return INTERPRET_RUNTIME_ERROR;
+
+    // whatever the task yields or returns lands on the main program's stack, where nobody needs it
+    InterpretResult result = run(vm);
+    if (result == INTERPRET_OK)
+        popFromStack(vm);
+    return result;
+}
+
+static bool callValue(VM *vm, Value callee, int argCount)
 {
     if (IS_OBJECT(callee))
     {
         switch (OBJ_TYPE(callee))
         {
         case OBJECT_FUNCTION:
-            return call(AS_FUNCTION(callee), argCount);
+            return call(vm, AS_FUNCTION(callee), argCount);
+        case OBJECT_COROUTINE:
+            return resume(vm, AS_COROUTINE(callee), argCount);
         case OBJECT_NATIVE:
             NativeFunction native = AS_NATIVE(callee);
-            Value result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1;
-            pushToStack(result);
+            Value result = native(vm, argCount, vm->stackTop - argCount);
+            vm->stackTop -= argCount + 1;
+
+            // the native parked the running task with the event loop, which resumes it with the actual result
+            if (vm->loop.suspendTask)
+            {
+                vm->loop.suspendTask = false;
+                suspendCoroutine(vm, NIL_VAL);
+                return true;
+            }
+            pushToStack(vm, result);
             return true;
 
         default:
             break;
         }
     }
-    runtimeError("Can only call functions and classes.");
+    runtimeError(vm, "Can only call functions and classes.");
     return false;
 }
 
@@ -163,25 +763,58 @@ static bool isFalsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+static void concatenate(VM *vm)
 {
-    StringObject *b = AS_STRING(popFromStack());
-    StringObject *a = AS_STRING(popFromStack());
+    Object *strings[2];
+    strings[1] = AS_OBJECT(popFromStack(vm));
+    strings[0] = AS_OBJECT(popFromStack(vm));
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    Object *result = concatenateStrings(vm, strings, 2);
+    pushToStack(vm, OBJECT_VAL(result));
+}
 
-    StringObject *result = takeString(chars, length);
-    pushToStack(OBJECT_VAL(result));
+// adds the top count values on the stack from left to right, like a chain of OP_ADDs would
+static bool addMany(VM *vm, int count)
+{
+    Value *operands = vm->stackTop - count;
+    bool allNumbers = true;
+    bool allStrings = true;
+    for (int i = 0; i < count; i++)
+    {
+        allNumbers = allNumbers && IS_NUMBER(operands[i]);
+        allStrings = allStrings && IS_ANY_STRING(operands[i]);
+    }
+
+    if (allNumbers)
+    {
+        double sum = AS_NUMBER(operands[0]);
+        for (int i = 1; i < count; i++)
+            sum += AS_NUMBER(operands[i]);
+        vm->stackTop = operands;
+        pushToStack(vm, NUMBER_VAL(sum));
+        return true;
+    }
+
+    if (allStrings)
+    {
+        Object *strings[UINT8_MAX];
+        for (int i = 0; i < count; i++)
+            strings[i] = AS_OBJECT(operands[i]);
+
+        Object *result = concatenateStrings(vm, strings, count);
+        vm->stackTop = operands;
+        pushToStack(vm, OBJECT_VAL(result));
+        return true;
+    }
+
+    runtimeError(vm, "Operands must be two numbers or two strings.");
+    return false;
 }
 
-static InterpretResult run()
+static InterpretResult run(VM *vm)
 {
     // current topmost callframe
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
 
 #define READ_BYTE() (*frame->instructionPointer++)
 #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
@@ -191,17 +824,17 @@ static InterpretResult run()
     (frame->instructionPointer += 2, (uint16_t)((frame->instructionPointer[-2] << 8) | frame->instructionPointer[-1]))
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                        \
-    do                                                  \
-    {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            runtimeError("Operands must be numbers.");  \
-            return INTERPRET_RUNTIME_ERROR;             \
-        }                                               \
-        double b = AS_NUMBER(popFromStack());           \
-        double a = AS_NUMBER(popFromStack());           \
-        pushToStack(valueType(a op b));                 \
+#define BINARY_OP(valueType, op)                                \
+    do                                                          \
+    {                                                           \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
+        {                                                       \
+            runtimeError(vm, "Operands must be numbers.");      \
+            return INTERPRET_RUNTIME_ERROR;                     \
+        }                                                       \
+        double b = AS_NUMBER(popFromStack(vm));                 \
+        double a = AS_NUMBER(popFromStack(vm));                 \
+        pushToStack(vm, valueType(a op b));                     \
     } while (false)
 
     for (;;)
@@ -210,14 +843,14 @@ static InterpretResult run()
 // logic to debug the vm (prints stack and disassembles instructions)
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+        for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
         {
             printf("[ ");
-            printValue(*slot);
+            printValue(vm, *slot);
             printf(" ]");
         }
         printf("\n");
-        disassembleInstruction(&frame->function->chunk, (int)(frame->instructionPointer - frame->function->chunk.code));
+        disassembleInstruction(vm, &frame->function->chunk, (int)(frame->instructionPointer - frame->function->chunk.code));
 #endif
 
         // read byte pointed by IP and advance IP
@@ -227,24 +860,24 @@ static InterpretResult run()
         case OP_CONSTANT:
         {
             Value constant = READ_CONSTANT();
-            pushToStack(constant);
+            pushToStack(vm, constant);
             break;
         }
         case OP_NIL:
-            pushToStack(NIL_VAL);
+            pushToStack(vm, NIL_VAL);
             break;
         case OP_FALSE:
-            pushToStack(BOOL_VAL(false));
+            pushToStack(vm, BOOL_VAL(false));
             break;
         case OP_TRUE:
-            pushToStack(BOOL_VAL(true));
+            pushToStack(vm, BOOL_VAL(true));
             break;
 
         case OP_EQUAL:
         {
-            Value b = popFromStack();
-            Value a = popFromStack();
-            pushToStack(BOOL_VAL(valuesEqual(a, b)));
+            Value b = popFromStack(vm);
+            Value a = popFromStack(vm);
+            pushToStack(vm, BOOL_VAL(valuesEqual(vm, a, b)));
             break;
         }
         case OP_GREATER:
@@ -256,23 +889,30 @@ static InterpretResult run()
 
         case OP_ADD:
         {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            if (IS_ANY_STRING(peek(vm, 0)) && IS_ANY_STRING(peek(vm, 1)))
             {
-                concatenate();
+                concatenate(vm);
             }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
             {
-                double b = AS_NUMBER(popFromStack());
-                double a = AS_NUMBER(popFromStack());
-                pushToStack(NUMBER_VAL(a + b));
+                double b = AS_NUMBER(popFromStack(vm));
+                double a = AS_NUMBER(popFromStack(vm));
+                pushToStack(vm, NUMBER_VAL(a + b));
             }
             else
             {
-                runtimeError("Operands must be two numbers or two strings.");
+                runtimeError(vm, "Operands must be two numbers or two strings.");
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
         }
+        case OP_ADD_N:
+        {
+            int count = READ_BYTE();
+            if (!addMany(vm, count))
+                return INTERPRET_RUNTIME_ERROR;
+            break;
+        }
         case OP_SUBTRACT:
             BINARY_OP(NUMBER_VAL, -);
             break;
@@ -284,65 +924,65 @@ static InterpretResult run()
             break;
 
         case OP_NOT:
-            pushToStack(BOOL_VAL(isFalsey(popFromStack())));
+            pushToStack(vm, BOOL_VAL(isFalsey(popFromStack(vm))));
             break;
         case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
+            if (!IS_NUMBER(peek(vm, 0)))
             {
-                runtimeError("Operand must be a number.");
+                runtimeError(vm, "Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            pushToStack(NUMBER_VAL(-AS_NUMBER(popFromStack())));
+            pushToStack(vm, NUMBER_VAL(-AS_NUMBER(popFromStack(vm))));
             break;
         case OP_PRINT:
         {
-            printValue(popFromStack());
-            printf("\n");
+            writeValue(vm, &vm->output, popFromStack(vm));
+            writeOutput(&vm->output, "\n", 1);
             break;
         }
         case OP_POP:
-            popFromStack();
+            popFromStack(vm);
             break;
         // locate the value from the stack and push it to the top of the stack.
         case OP_GET_LOCAL:
         {
             uint8_t slot = READ_BYTE();
-            pushToStack(frame->slots[slot]);
+            pushToStack(vm, frame->slots[slot]);
             break;
         }
         // take the assigned value from top of the stack and store it in the stack slot.
         case OP_SET_LOCAL:
         {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
+            frame->slots[slot] = peek(vm, 0);
             break;
         }
         case OP_DEFINE_GLOBAL:
         {
             StringObject *name = READ_STRING();
-            tableAdd(&vm.globals, name, peek(0));
-            popFromStack();
+            tableAdd(vm, &vm->globals, name, peek(vm, 0));
+            popFromStack(vm);
             break;
         }
         case OP_GET_GLOBAL:
         {
             StringObject *name = READ_STRING();
             Value value;
-            if (!tableGet(&vm.globals, name, &value))
+            if (!tableGet(&vm->globals, name, &value))
             {
-                runtimeError("Undefined variable '%s'.", name->chars);
+                runtimeError(vm, "Undefined variable '%s'.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            pushToStack(value);
+            pushToStack(vm, value);
             break;
         }
         case OP_SET_GLOBAL:
         {
             StringObject *name = READ_STRING();
-            if (tableAdd(&vm.globals, name, peek(0)))
+            if (tableAdd(vm, &vm->globals, name, peek(vm, 0)))
             {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
+                tableDelete(vm, &vm->globals, name);
+                runtimeError(vm, "Undefined variable '%s'.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
@@ -356,7 +996,7 @@ static InterpretResult run()
         case OP_JUMP_IF_FALSE:
         {
             uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
+            if (isFalsey(peek(vm, 0)))
                 frame->instructionPointer += offset;
             break;
         }
@@ -364,31 +1004,66 @@ static InterpretResult run()
         {
             uint16_t offset = READ_SHORT();
             frame->instructionPointer -= offset;
+
+            // loop back-edges and calls are safe points: everything live is on the stack or in a global
+            if (vm->bytesAllocated > vm->nextGC)
+                collectGarbage(vm);
             break;
         }
         case OP_CALL:
         {
+            if (vm->bytesAllocated > vm->nextGC)
+                collectGarbage(vm);
+
             int argCount = READ_BYTE();
-            if (!callValue(peek(argCount), argCount))
+            if (!callValue(vm, peek(vm, argCount), argCount))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
+
+            // a task that waits goes back to the event loop
+            if (vm->frameCount == 0)
+                return INTERPRET_OK;
+            frame = &vm->frames[vm->frameCount - 1];
             break;
         }
         case OP_RETURN:
         {
-            Value result = popFromStack();
-            vm.frameCount--;
-            if (vm.frameCount == 0)
+            Value result = popFromStack(vm);
+            vm->frameCount--;
+
+            // the callee and its arguments are replaced by the result
+            vm->stackTop = frame->slots;
+            if (vm->frameCount == 0 && vm->coroutine != NULL)
             {
-                popFromStack();
+                // a coroutine that returns hands the result to its resumer like a last yield
+                CoroutineObject *coroutine = vm->coroutine;
+                coroutine->state = COROUTINE_DONE;
+                switchStacks(vm, coroutine->resumer);
+                vm->coroutineDepth--;
+                freeCoroutineStacks(vm, coroutine);
+            }
+            pushToStack(vm, result);
+            if (vm->frameCount == 0)
                 return INTERPRET_OK;
+
+            frame = &vm->frames[vm->frameCount - 1];
+            break;
+        }
+        case OP_YIELD:
+        {
+            Value value = popFromStack(vm);
+            if (vm->coroutine == NULL)
+            {
+                runtimeError(vm, "Can only yield inside a coroutine.");
+                return INTERPRET_RUNTIME_ERROR;
             }
 
-            vm.stackTop = frame->slots;
-            pushToStack(result);
-            frame = &vm.frames[vm.frameCount - 1];
+            // the coroutine's stacks are left as they are, so it continues right here when resumed
+            suspendCoroutine(vm, value);
+            if (vm->frameCount == 0)
+                return INTERPRET_OK;
+            frame = &vm->frames[vm->frameCount - 1];
             break;
         }
 
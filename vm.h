@@ -1,34 +1,82 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <pthread.h>
+
 #include "chunk.h"
+#include "eventloop.h"
+#include "linker.h"
+#include "memory.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// the stacks of the main program and of every coroutine start with room for this many call frames
+// and UINT8_COUNT values, and grow when a call needs more
+#define FRAMES_MIN 8
 
-typedef struct
-{
-    FunctionObject *function;
-    uint8_t *instructionPointer;
-    Value *slots; // The first slot on the VM's value stack that the function can use
-} CallFrame;
+// the default for VM.frameLimit
+#define FRAMES_MAX (8 * 1024)
 
-typedef struct
+// how deep coroutines can resume each other before it counts as a stack overflow
+#define COROUTINES_MAX 64
+
+// a VM owns everything a running program touches: its stacks, globals, heap and output.
+// VMs share nothing, so several of them can run side by side, each on its own thread
+struct VM
 {
-    CallFrame frames[FRAMES_MAX];
+    // the stacks of whatever runs right now: the main program or a coroutine
+    CallFrame *frames;
     int frameCount; // current height of callframe stack. i.e., no. of ongoing function calls
-
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    Value *stack;
     Value *stackTop; // points past the last item of the stack
+    int stackCapacity;
+    CoroutineObject *coroutine; // the running coroutine, NULL while the main program runs
+    int coroutineDepth;         // how many coroutines are waiting for the one they resumed, plus the running one
+
+    // no call chain gets deeper than this, in the main program or in a coroutine. Can be changed after initVM()
+    int frameLimit;
+
+    // the main program's stacks, put aside here while a coroutine runs
+    CallFrame *mainFrames;
+    int mainFrameCount;
+    int mainFrameCapacity;
+    Value *mainStack;
+    Value *mainStackTop;
+    int mainStackCapacity;
+
     Table globals;   // stores global variables
     Table strings;   // stores all the strings
+    ValueArray pinned; // values the host holds on to, see pinValue()
+    int pinnedFree;    // first unused slot of pinned or -1. Each unused slot holds the index of the next one as a number
+
+    // the arguments of the host's call that runs right now and the results it got so far, see callBatch()
+    Value *hostArgs;
+    int hostArgCount;
+    Value *hostResults;
+    int hostResultCount;
 
     // All objects are stored in a singly linked list. This pointer points to the head of the list.
     Object *objects;
-} VM;
+    Region region; // see beginRegion()
+
+    CodeSegment *segments; // read-only segments that linked functions point into
+    OutputBuffer output;   // everything the script prints goes through this buffer
+    EventLoop loop;        // runs the tasks the program spawned once its scripts are done
+
+    size_t bytesAllocated; // bytes currently allocated through reallocate()
+    size_t nextGC;         // the next collection runs once bytesAllocated grows past this
+    Object *frozenObjects; // the newest object freezeObjects() made permanent. Sweeps stop there
+    MarkSet marks;
+    int grayCount;
+    int grayCapacity;
+    Object **grayStack; // marked objects whose references haven't been traced yet
+
+    PoolCache pools;          // free lists for small allocations
+    pthread_mutex_t heapLock; // see lockHeap()
+};
 
 typedef enum
 {
@@ -37,13 +85,56 @@ typedef enum
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+void initVM(VM *vm);
+InterpretResult interpretCode(VM *vm, const char *sourceCode);
+
+// compiles all sources in parallel, then runs them in order in this VM, sharing its globals
+InterpretResult interpretSources(VM *vm, const char **sources, int count);
+void freeVM(VM *vm);
+
+// drops every object and global, so the VM can run an unrelated program.
+// the memory pools are kept and reused
+void resetVM(VM *vm);
+
+// calls the global function with the given name and stores what it returns in result
+InterpretResult callFunction(VM *vm, const char *name, int argCount, Value *args, Value *result);
+
+// keeps value alive until unpinValue() is called with the returned index, no matter what the program does.
+// values the host keeps between calls into the VM, like strings it made with copyString(), need this
+int pinValue(VM *vm, Value value);
+void unpinValue(VM *vm, int index);
+
+// a global function the host looked up once, so it can call it again and again without looking it up by name
+typedef struct
+{
+    FunctionObject *function;
+    int pin; // the function stays pinned while the host holds the handle
+} FunctionHandle;
+
+// looks up the global function with the given name. The handle keeps working when the global is reassigned.
+// returns false if there is no such function, without reporting it
+bool findFunction(VM *vm, const char *name, FunctionHandle *handle);
+void releaseFunction(VM *vm, FunctionHandle *handle);
+
+// calls the function with argCount arguments and stores what it returns in result.
+// an object in result is only safe to use until the next call into the VM, unless it is pinned
+InterpretResult callHandle(VM *vm, FunctionHandle *handle, int argCount, Value *args, Value *result);
+
+/*
+calls the function callCount times in a row, with argCount arguments each time. args holds the arguments of
+the first call, then those of the second and so on, and results gets one value per call.
+the calls' output is flushed and the tasks they spawned are run only once the last call returned.
+stops at the first call that fails. callsDone, if not NULL, gets the number of calls that finished
+*/
+InterpretResult callBatch(VM *vm, FunctionHandle *handle, int callCount, int argCount, Value *args, Value *results,
+                          int *callsDone);
+
+// continues a task where it waited. value becomes the result of whatever it waited for
+InterpretResult resumeTask(VM *vm, CoroutineObject *task, Value value);
 
-void initVM();
-InterpretResult interpretCode(const char *sourceCode);
-void freeVM();
+void defineNative(VM *vm, const char *name, NativeFunction function);
 
-void pushToStack(Value value);
-Value popFromStack();
+void pushToStack(VM *vm, Value value);
+Value popFromStack(VM *vm);
 
 #endif
\ No newline at end of file